@@ -0,0 +1,62 @@
+/*
+ * Christian Roy
+ * Routing C++ allocations through the allocator in mm.c
+ *
+ * A memory resource that owns the mm.c heap.
+ */
+
+#include "MMResource.h"
+#include <stdexcept>
+
+using namespace std;
+
+// mm_malloc always returns payloads aligned to this many bytes
+static const size_t MM_ALIGNMENT = 16;
+
+// Whether an MMResource currently owns the heap
+static bool heapOwned = false;
+
+// Constructor
+MMResource::MMResource(){
+    if (heapOwned){
+        throw logic_error("only one MMResource can exist at a time");
+    }
+    heapOwned = true;
+    mm_init();
+}
+
+// Destructor, which releases the whole heap at once
+MMResource::~MMResource(){
+    mm_deinit();
+    heapOwned = false;
+}
+
+mm_stats MMResource::stats() const {
+    mm_stats s;
+    mm_get_stats(&s);
+    return s;
+}
+
+void* MMResource::do_allocate(size_t bytes, size_t alignment){
+    // Over-aligned requests can't be satisfied without wasting most of a block
+    if (alignment > MM_ALIGNMENT){
+        throw bad_alloc();
+    }
+
+    // memory_resource allows zero bytes, but mm.c needs room for a free block's
+    // links once it is freed
+    void* p = mm_malloc(bytes > 0 ? bytes : 1);
+    if (p == nullptr){
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void MMResource::do_deallocate(void* p, size_t, size_t){
+    mm_free(p);
+}
+
+// Two resources are only equal if they are the same object
+bool MMResource::do_is_equal(const memory_resource& other) const noexcept {
+    return this == &other;
+}
@@ -0,0 +1,70 @@
+/*
+ * Christian Roy
+ * Routing C++ allocations through the allocator in mm.c
+ *
+ */
+
+#ifndef MMRESOURCE_H
+#define MMRESOURCE_H
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include "mm.h"
+
+// A memory resource that owns the mm.c heap. Constructing one starts a fresh
+// heap and destroying it unmaps every page of it, so everything allocated from
+// it is released in one step. mm.c has a single heap, so only one of these may
+// exist at a time.
+class MMResource : public std::pmr::memory_resource {
+    public:
+    // Constructors and deconstructor
+    MMResource();
+    ~MMResource();
+
+    // The heap can't be shared between two owners
+    MMResource(const MMResource&) = delete;
+    MMResource& operator=(const MMResource&) = delete;
+
+    // Returns a snapshot of the heap
+    mm_stats stats() const;
+
+    private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// A standard allocator that calls mm_malloc and mm_free directly, for
+// containers that don't take a memory resource. The heap must have been
+// started by an MMResource (or mm_init) before it is used.
+template <class T>
+class MMAllocator {
+    public:
+    typedef T value_type;
+
+    MMAllocator() noexcept {}
+    template <class U> MMAllocator(const MMAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n){
+        if (n > static_cast<std::size_t>(-1) / sizeof(T)){
+            throw std::bad_alloc();
+        }
+        void* p = mm_malloc(n * sizeof(T));
+        if (p == nullptr){
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t) noexcept { mm_free(p); }
+};
+
+// Every MMAllocator uses the same heap
+template <class T, class U>
+bool operator==(const MMAllocator<T>&, const MMAllocator<U>&) noexcept { return true; }
+
+template <class T, class U>
+bool operator!=(const MMAllocator<T>&, const MMAllocator<U>&) noexcept { return false; }
+
+#endif
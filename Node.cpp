@@ -13,17 +13,22 @@ using namespace std;
 // Constructors
 
 // Create an empty node with a word flag with a false bool value
-Node::Node(){
+Node::Node(pmr::memory_resource *resource){
     for (size_t i = 0; i < 27; i++){
         potentialBranches[i] = nullptr;
     }
     _isWord = false;
+    this->resource = resource;
 }
 
 
-// Copy constructor
-Node::Node(const Node& nodeToCopy){
+// Copy constructor, allocating the copy from the same resource
+Node::Node(const Node& nodeToCopy) : Node(nodeToCopy, nodeToCopy.resource) {}
+
+// Copy constructor, allocating the copy from the given resource
+Node::Node(const Node& nodeToCopy, pmr::memory_resource *resource){
     this->_isWord = nodeToCopy._isWord;
+    this->resource = resource;
 
     for (size_t i = 0; i < 27; i++){
         potentialBranches[i] = nullptr;
@@ -32,7 +37,7 @@ Node::Node(const Node& nodeToCopy){
     // Go through and copy each node
     for (size_t i = 0; i < 27; i++){
         if (nodeToCopy.potentialBranches[i] != nullptr){
-            this->potentialBranches[i] = new Node(*nodeToCopy.potentialBranches[i]);
+            this->potentialBranches[i] = create(*nodeToCopy.potentialBranches[i], resource);
         }
 
     }
@@ -45,12 +50,35 @@ Node::~Node(){
     for (int i = 0; i < 27; i++){
         // Don't delete nullptr
         if (potentialBranches[i] != nullptr) {
-            delete potentialBranches[i];
+            destroy(potentialBranches[i]);
             potentialBranches[i] = nullptr;
         }
     }
 }
 
+// Allocate an empty node from a resource
+Node* Node::create(pmr::memory_resource *resource){
+    pmr::polymorphic_allocator<Node> alloc(resource);
+    Node *node = alloc.allocate(1);
+    alloc.construct(node, resource);
+    return node;
+}
+
+// Allocate a copy of a node from a resource
+Node* Node::create(const Node& nodeToCopy, pmr::memory_resource *resource){
+    pmr::polymorphic_allocator<Node> alloc(resource);
+    Node *node = alloc.allocate(1);
+    alloc.construct(node, nodeToCopy, resource);
+    return node;
+}
+
+// Destroy a node and return it to the resource it came from
+void Node::destroy(Node *node){
+    pmr::polymorphic_allocator<Node> alloc(node->resource);
+    node->~Node();
+    alloc.deallocate(node, 1);
+}
+
 // Add a word to this node if the word doesn't exist yet
 void Node::addWord(string word){
     // Check if it is an empty string
@@ -63,7 +91,7 @@ void Node::addWord(string word){
 
         // If the index contains a nullptr, create a new node
         if ( potentialBranches[index] == nullptr ){
-            potentialBranches[index] = new Node();
+            potentialBranches[index] = create(resource);
         }
 
         // check if there is more of the word to add
@@ -106,24 +134,24 @@ bool Node::isWord(string word){
 }
 
 // Returns all words in the tree with the given prefix, including the prefix itself if it is a word.
-vector<string> Node::getWords(){
-    vector<string> words;
-    vector<string> subwords;
+pmr::vector<pmr::string> Node::getWords(){
+    pmr::vector<pmr::string> words(resource);
+    pmr::vector<pmr::string> subwords(resource);
 
     for (int i=0; i<27; i++){
         if (potentialBranches[i] != nullptr){
             const char firstChar = i + 96;
 
-            string newWord;
+            pmr::string newWord(resource);
             newWord += firstChar;
 
-            if (this->isWord(newWord)){
+            if (potentialBranches[i]->_isWord){
                 words.push_back(newWord);
             }
 
             subwords = potentialBranches[i]->getWords();
             for (auto it = subwords.begin(); it != subwords.end(); it++){
-                string temp = newWord;
+                pmr::string temp(newWord, resource);
                 temp.append(*it);
                 words.push_back(temp);
             }
@@ -146,13 +174,18 @@ Node& Node::operator=(const Node& rhsNode) {
 
          // Delete old branches
          for (int i=0; i<27; i++){
-             delete potentialBranches[i];
+             if (potentialBranches[i] != nullptr){
+                 destroy(potentialBranches[i]);
+             }
              potentialBranches[i] = nullptr;
          }
 
-         // Copy branches from rhs
+         // Copy branches from rhs into this node's resource
          for (size_t index = 0; index < 27; index++){
-             newPotentialBranches[index] = new Node(*rhsNode.potentialBranches[index]);
+             newPotentialBranches[index] = nullptr;
+             if (rhsNode.potentialBranches[index] != nullptr){
+                 newPotentialBranches[index] = create(*rhsNode.potentialBranches[index], resource);
+             }
          }
 
          // Assign Potential Branches to copy of potential branches from rhs
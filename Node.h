@@ -9,6 +9,7 @@
 
 #include <string>
 #include <vector>
+#include <memory_resource>
 
 // This class is meant to be used as nodes in a tree.
 class Node {
@@ -17,13 +18,21 @@ class Node {
     bool _isWord;
     // Contains pointers to the other characters that come after this nodes data
     Node *potentialBranches[27];
+    // Where this node's branches and word lists are allocated from
+    std::pmr::memory_resource *resource;
 
     // Constructors and deconstructor
-    Node();
+    Node(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
     Node(const Node&);
+    Node(const Node&, std::pmr::memory_resource *resource);
     //Node(const Node& nodeToCopy);
     ~Node();
 
+    // Allocate and free nodes from a memory resource, in place of new and delete
+    static Node* create(std::pmr::memory_resource *resource);
+    static Node* create(const Node& nodeToCopy, std::pmr::memory_resource *resource);
+    static void destroy(Node *node);
+
 
     // Add a word to this node if the word doesn't exist yet
     void addWord(std::string word);
@@ -32,7 +41,7 @@ class Node {
     bool isWord(std::string word);
 
     // Returns all words in the tree with the given prefix, including the prefix itself if it is a word.
-    std::vector< std::string > getWords();
+    std::pmr::vector< std::pmr::string > getWords();
 
     // Overloaded operators
     Node& operator=(const Node&);
@@ -10,17 +10,19 @@
 
 using namespace std;
 
-// Constructor
-Trie::Trie(){
-    rootNode = new Node();
+// Constructor, allocating every node from the given resource
+Trie::Trie(pmr::memory_resource *resource){
+    this->resource = resource;
+    rootNode = Node::create(resource);
 }
 
-Trie::~Trie(){ delete rootNode; }
+Trie::~Trie(){ Node::destroy(rootNode); }
 
-// Copy Constructor
+// Copy Constructor, sharing the resource of the Trie being copied
 Trie::Trie(const Trie& trieToCopy){
     rootNode = nullptr;
-    this->rootNode = new Node(*trieToCopy.rootNode);
+    this->resource = trieToCopy.resource;
+    this->rootNode = Node::create(*trieToCopy.rootNode, resource);
 
 }
 
@@ -44,11 +46,11 @@ Trie& Trie::operator=(const Trie& rhsTrie){
     // Only do assignment if RHS is a different object from this.
     if (this != &rhsTrie) {
         if (rootNode != nullptr){
-            delete rootNode;
+            Node::destroy(rootNode);
             rootNode = nullptr;
         }
-        // Deallocate, allocate new space, copy values...
-        this->rootNode = new Node(*rhsTrie.rootNode);
+        // Deallocate, allocate new space in this Trie's resource, copy values...
+        this->rootNode = Node::create(*rhsTrie.rootNode, resource);
     }
 
     return *this;
@@ -56,8 +58,8 @@ Trie& Trie::operator=(const Trie& rhsTrie){
 
 
 // Returns all words in the tree with the given prefix, including the prefix itself if it is a word.
-vector<string> Trie::allWordsWithPrefix(string word){
-    vector<string> words;
+pmr::vector<pmr::string> Trie::allWordsWithPrefix(string word){
+    pmr::vector<pmr::string> words(resource);
     vector<int> prefix;
 
     // Find the pathway to the node containing the last letter of the prefix
@@ -75,16 +77,16 @@ vector<string> Trie::allWordsWithPrefix(string word){
 
     // If the prefix is a word, add it to the list of words
     if (rootNode->isWord(word)){
-        words.push_back(word);
+        words.emplace_back(word.begin(), word.end());
     }
 
     // Get all words with the prefix
-    vector<string> subwords = endOfPrefix->getWords();
-    string newWord;
+    pmr::vector<pmr::string> subwords = endOfPrefix->getWords();
+    pmr::string newWord(resource);
 
     // Go through and append the prefix onto each of the subwords
     for (auto it = subwords.begin(); it != subwords.end(); it++){
-        newWord = word;
+        newWord.assign(word.begin(), word.end());
         words.push_back(newWord.append(*it));
     }
 
@@ -95,7 +97,7 @@ vector<string> Trie::allWordsWithPrefix(string word){
 ostream& operator<<(ostream& output, Trie tr){
     output << "Words in the tree: ";
 
-    vector<string> words = tr.allWordsWithPrefix("");
+    pmr::vector<pmr::string> words = tr.allWordsWithPrefix("");
     string temp;
 
     for (auto it = words.begin(); it != words.end(); it++){
@@ -22,9 +22,12 @@ class Trie {
     // How many nodes have been added to the dictionary
     int numOfNodes;
 
+    // Where the nodes and word lists of this Trie are allocated from
+    std::pmr::memory_resource *resource;
+
     public:
     // Constructors and deconstructor
-    Trie();
+    Trie(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
     ~Trie();
     Trie(const Trie&);
 
@@ -43,7 +46,8 @@ class Trie {
     bool isWord(std::string word);
 
     // Returns all words in the tree with the given prefix, including the prefix itself if it is a word.
-    std::vector<std::string> allWordsWithPrefix(std::string);
+    // The list is allocated from the Trie's memory resource.
+    std::pmr::vector<std::pmr::string> allWordsWithPrefix(std::string);
 };
 
 #endif
@@ -0,0 +1,69 @@
+/*
+ * memlib.c - A stand-in for the course memlib, built directly on mmap so the
+ *     allocator in mm.c can be run and benchmarked on its own.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+/* bytes currently mapped */
+static size_t heap_size;
+
+/* most bytes mapped at once since the last mem_reset_peak */
+static size_t peak_heap_size;
+
+/*
+ * mem_map - map size bytes of zeroed memory, exiting if the OS refuses
+ */
+void *mem_map(size_t size)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (p == MAP_FAILED)
+  {
+    perror("mem_map");
+    exit(1);
+  }
+
+  heap_size += size;
+  if (heap_size > peak_heap_size)
+    peak_heap_size = heap_size;
+
+  return p;
+}
+
+/*
+ * mem_unmap - unmap part or all of an earlier mapping
+ */
+void mem_unmap(void *addr, size_t size)
+{
+  if (munmap(addr, size) != 0)
+  {
+    perror("mem_unmap");
+    exit(1);
+  }
+  heap_size -= size;
+}
+
+size_t mem_pagesize(void)
+{
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+size_t mem_heapsize(void)
+{
+  return heap_size;
+}
+
+size_t mem_peak_heapsize(void)
+{
+  return peak_heap_size;
+}
+
+void mem_reset_peak(void)
+{
+  peak_heap_size = heap_size;
+}
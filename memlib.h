@@ -0,0 +1,25 @@
+/*
+ * memlib.h - Page mapping interface used by mm.c
+ */
+#ifndef MEMLIB_H
+#define MEMLIB_H
+
+#include <stddef.h>
+
+/* Map size bytes of zeroed, page-aligned memory */
+void *mem_map(size_t size);
+
+/* Return size bytes starting at addr to the OS */
+void mem_unmap(void *addr, size_t size);
+
+/* The size of a page, which every mem_map size must be a multiple of */
+size_t mem_pagesize(void);
+
+/* Bytes currently mapped, and the most that have been mapped at once */
+size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
+
+/* Start tracking the peak from the current heap size */
+void mem_reset_peak(void);
+
+#endif
@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -97,12 +99,59 @@ typedef struct {
 /* page prolog */
 #define PAGE_PROLOG(ph) ((char*)(ph) + sizeof(page_header))
 
+/* the size of a page, kept in its prolog */
+#define PAGE_SIZE(ph) ((prolog*)(PAGE_PROLOG(ph)))->page_size
+
+/* the end block's payload points back at the start of its page */
+#define PAGE_OF_END(bp) (*(void **)(bp))
+
+/* size and alignment of a transparent huge page */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/* rounds up to the nearest multiple of HUGE_PAGE_SIZE */
+#define HUGE_ALIGN(size) (((size) + (HUGE_PAGE_SIZE-1)) & ~(HUGE_PAGE_SIZE-1))
+
+/* free blocks at least this big are kept in the size tree instead of the free list */
+#define LARGE_BLOCK_SIZE 1024
+
+/* Large free blocks keep their size tree links at the start of their payload */
+typedef struct {
+  void *left;
+  void *right;
+  long height;
+} tree_node;
+
+/* the size tree links of a large free block */
+#define TREE_LEFT(bp) ((tree_node*)(bp))->left
+#define TREE_RIGHT(bp) ((tree_node*)(bp))->right
+#define TREE_HEIGHT(bp) ((bp) ? ((tree_node*)(bp))->height : 0)
+
+/* An empty page waiting in the page cache keeps this where its first block was */
+typedef struct {
+  long emptied_at;
+  int advised;
+} cached_page;
+
+/* the cache entry of an empty page */
+#define CACHED_PAGE(ph) ((cached_page*)PAGE_FIRST_BP(ph))
+
+static void *find_fit(size_t size);
 static void set_allocated(void *bp, size_t size);
+static void set_allocated_run(void *bp, size_t size, size_t n, void **out);
+static void release_block(void *bp);
+static int compare_pointers(const void *a, const void *b);
 static void *coalesce(void *bp);
-static void checker();
 static void remove_block_from_free_list(void *bp);
 static void add_block_to_free_list(void *bp);
 static void remove_page_of_bp(void *bp);
+static void *tree_insert(void *root, void *bp);
+static void *tree_remove(void *root, void *bp);
+static void *tree_best_fit(size_t size);
+static void *map_page(size_t *size);
+static void *take_cached_page(size_t size);
+static void decay_page_cache(void);
+static long now_ms(void);
+static int size_class(size_t size);
 
 /* first block payload pointer */
 static void *first_bp;
@@ -110,12 +159,39 @@ static void *first_bp;
 /* last freed block */
 static void *last_freed;
 
+/* root of the size tree of large free blocks */
+static void *tree_root;
+
 /* first page pointer */
 static void *first_page;
 
 /* minimum size of a page request */
 static int min_page_size;
 
+/* running totals reported by mm_get_stats */
+static size_t pages_mapped;
+static size_t bytes_mapped;
+static size_t bytes_free;
+static size_t free_blocks;
+static size_t free_histogram[MM_STATS_BUCKETS];
+
+/* empty pages kept mapped for reuse, newest first */
+static void *cache_first;
+static void *cache_last;
+static size_t cached_pages;
+static size_t cached_bytes;
+
+/* how many empty pages to keep, and for how long (in ms, negative for no limit);
+   none until mm_set_page_retention asks for some */
+static size_t retain_max_pages = 0;
+static long retain_decay_ms = 1000;
+
+/* release decayed pages with madvise before unmapping them */
+static int retain_madvise;
+
+/* back pages with transparent huge pages */
+static int huge_pages;
+
 /* 
  * mm_init - initialize the malloc package.
  */
@@ -124,13 +200,26 @@ int mm_init(void)
   min_page_size = (mem_pagesize()*7);
   size_t size = min_page_size;
 
+  // Reset the statistics
+  pages_mapped = 0;
+  bytes_mapped = 0;
+  bytes_free = 0;
+  free_blocks = 0;
+  memset(free_histogram, 0, sizeof(free_histogram));
+  cache_first = 0;
+  cache_last = 0;
+  cached_pages = 0;
+  cached_bytes = 0;
+
   // Request a page
-  first_page = mem_map(size);
+  first_page = map_page(&size);
   PAGE_PREV(first_page) = 0;
   PAGE_NEXT(first_page) = 0;
+  pages_mapped++;
+  bytes_mapped += size;
 
   // Create prolog
-  PUT(HDRP(PAGE_PROLOG(first_page)), PACK(32, 0x1, 0x3));
+  PUT(PAGE_PROLOG(first_page), PACK(32, 0x1, 0x3));
   ((prolog*)(PAGE_PROLOG(first_page)))->page_size = size;
 
   // Create first bp
@@ -139,17 +228,91 @@ int mm_init(void)
   PUT(FTRP(first_bp), PACK(size - PAGE_OVERHEAD, 0x0, 0x2));
 
   // SET UP FREE LIST POINTERS
-  NEXT_FREE(first_bp) = 0;
-  PREV_FREE(first_bp) = 0;
-  last_freed = first_bp;
+  last_freed = 0;
+  tree_root = 0;
+  add_block_to_free_list(first_bp);
 
   // Create end block
   void *bp = NEXT_BLKP(first_bp);
   PUT(HDRP(bp), PACK(0, 0x1, 0x00));
+  PAGE_OF_END(bp) = first_page;
 
   return 0;
 }
 
+/*
+ * mm_deinit - return every page to the OS. mm_init must be called again
+ *     before the allocator is used.
+ */
+void mm_deinit(void)
+{
+  void *pp = first_page;
+  void *next;
+
+  while (pp != NULL)
+  {
+    next = PAGE_NEXT(pp);
+    mem_unmap(pp, PAGE_SIZE(pp));
+    pp = next;
+  }
+  mm_trim();
+
+  first_page = 0;
+  first_bp = 0;
+  last_freed = 0;
+  tree_root = 0;
+  pages_mapped = 0;
+  bytes_mapped = 0;
+  bytes_free = 0;
+  free_blocks = 0;
+  memset(free_histogram, 0, sizeof(free_histogram));
+}
+
+/*
+ * map_page - maps a new page of at least *size bytes, storing its actual size in *size.
+ *     With huge pages on, the page is rounded up to whole huge pages and aligned to
+ *     a huge page boundary by mapping extra and unmapping the ends.
+ */
+static void *map_page(size_t *size)
+{
+  char *raw, *aligned;
+  size_t head;
+
+  if (!huge_pages)
+  {
+    return mem_map(*size);
+  }
+
+  *size = HUGE_ALIGN(*size);
+  raw = mem_map(*size + HUGE_PAGE_SIZE);
+  aligned = (char *)HUGE_ALIGN((size_t)raw);
+  head = aligned - raw;
+
+  // Trim the unaligned ends of the mapping
+  if (head != 0)
+  {
+    mem_unmap(raw, head);
+  }
+  if (HUGE_PAGE_SIZE - head != 0)
+  {
+    mem_unmap(aligned + *size, HUGE_PAGE_SIZE - head);
+  }
+
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, *size, MADV_HUGEPAGE);
+#endif
+
+  return aligned;
+}
+
+/*
+ * mm_set_huge_pages - Turn huge page backing on or off for pages mapped from now on
+ */
+void mm_set_huge_pages(int enable)
+{
+  huge_pages = enable;
+}
+
 /*
  * extend - adds a new page of memory.
  *     returns the pointer to the first block payload
@@ -157,7 +320,7 @@ int mm_init(void)
 static void *extend(size_t size) 
 {
   void *lp, *pp, *bp;
-  int current_avail_size = 0;
+  size_t current_avail_size = 0;
 
   // Calculate if we need a bigger page than the minimum
   if (size < (min_page_size - PAGE_OVERHEAD))
@@ -177,15 +340,30 @@ static void *extend(size_t size)
     lp = PAGE_NEXT(lp);
   }
   
-  // Pull in a new page and link it to the other pages
-  pp = mem_map(current_avail_size);
+  // Reuse an empty page if one is cached, otherwise pull in a new page.
+  // Pages that sat in the cache too long go first, so they don't outlive
+  // their decay time just because no other page has emptied since.
+  decay_page_cache();
+  pp = take_cached_page(current_avail_size);
+  if (pp != NULL)
+  {
+    current_avail_size = PAGE_SIZE(pp);
+  }
+  else
+  {
+    pp = map_page(&current_avail_size);
+  }
+
+  // Link it to the other pages
   PAGE_NEXT(lp) = pp;
   PAGE_PREV(pp) = lp;
   PAGE_NEXT(pp) = 0;
+  pages_mapped++;
+  bytes_mapped += current_avail_size;
 
   // Create prolog
-  PUT(HDRP(PAGE_PROLOG(pp)), PACK(32, 0x1, 0x3));
-  ((prolog*)(PAGE_PROLOG(first_page)))->page_size = current_avail_size;
+  PUT(PAGE_PROLOG(pp), PACK(32, 0x1, 0x3));
+  ((prolog*)(PAGE_PROLOG(pp)))->page_size = current_avail_size;
 
   // Set up the first bp on this page
   bp = PAGE_FIRST_BP(pp);
@@ -198,6 +376,7 @@ static void *extend(size_t size)
   // Create end block
   bp = NEXT_BLKP(bp);
   PUT(HDRP(bp), PACK(0, 0x1, 0x00));
+  PAGE_OF_END(bp) = pp;
   
   return PAGE_FIRST_BP(pp);
 }
@@ -212,28 +391,47 @@ void *mm_malloc(size_t size)
   int new_size = ALIGN(size + BLOCK_OVERHEAD);
   void *bp;
 
-  // IF LAST FREED == 0, THEN WE USED UP ALL THE SPACE ON ALL OF OUR PAGES
-  if (last_freed != 0)
+  // USE AN EMPTY BLOCK THAT IS LARGE ENOUGH IF THERE IS ONE
+  bp = find_fit(new_size);
+  if (bp != 0)
+  {
+    set_allocated(bp, new_size);
+    return bp;
+  }
+
+  // PULL IN A NEW PAGE IF THERE ISN"T ANY CELL LARGE ENOUGH
+  bp = extend(new_size);
+
+  // ALLOCATE THE FIRST BLOCK ON THE NEW PAGE
+  set_allocated(bp, new_size);
+  return bp;
+}
+
+/*
+ * find_fit - Find an empty block of at least size bytes, or 0 if there isn't one
+ */
+static void *find_fit(size_t size)
+{
+  void *bp;
+
+  // SMALL REQUESTS TAKE THE FIRST FIT FROM THE FREE LIST
+  // IF LAST FREED == 0, THERE ARE NO SMALL FREE BLOCKS LEFT
+  if (size < LARGE_BLOCK_SIZE && last_freed != 0)
   {
     // FIND AN EMPTY BLOCK THAT IS LARGE ENOUGH
     bp = last_freed;
     do
     {
-  	  if (!GET_ALLOC(HDRP(bp)) && (GET_SIZE(HDRP(bp)) >= new_size))
+  	  if (!GET_ALLOC(HDRP(bp)) && (GET_SIZE(HDRP(bp)) >= size))
       {
-        set_allocated(bp, new_size);
         return bp;
       }
   	  bp = NEXT_FREE(bp);
     } while (bp != 0);
   }
 
-  // PULL IN A NEW PAGE IF THERE ISN"T ANY CELL LARGE ENOUGH
-  bp = extend(new_size);
-
-  // ALLOCATE THE FIRST BLOCK ON THE NEW PAGE
-  set_allocated(bp, new_size);
-  return bp;
+  // OTHERWISE TAKE THE BEST FIT FROM THE SIZE TREE
+  return tree_best_fit(size);
 }
 
 /*
@@ -241,12 +439,33 @@ void *mm_malloc(size_t size)
  */
 static void set_allocated(void *bp, size_t size)
 {
-  size_t extra_size = GET_SIZE(HDRP(bp)) - size;
+  set_allocated_run(bp, size, 1, NULL);
+}
+
+/*
+ * set_allocated_run - carves n allocated blocks of size from the front of a given
+ *     empty block, storing their payload pointers in out if it isn't NULL
+ */
+static void set_allocated_run(void *bp, size_t size, size_t n, void **out)
+{
+  size_t extra_size = GET_SIZE(HDRP(bp)) - size*n;
+  size_t i;
 
   // Remove this block from the free list
   remove_block_from_free_list(bp);
 
-  // DETERMINE IF WE NEED TO SPLIT THE BLOCK
+  // ALLOCATE EVERY BLOCK BUT THE LAST ONE
+  for (i = 0; i < n - 1; i++)
+  {
+    if (out != NULL)
+      out[i] = bp;
+    PUT(HDRP(bp), PACK(size, 0x1, 0x2));
+    bp = NEXT_BLKP(bp);
+  }
+  if (out != NULL)
+    out[n - 1] = bp;
+
+  // DETERMINE IF WE NEED TO SPLIT THE LAST BLOCK
   if (extra_size > ALIGN(1 + BLOCK_OVERHEAD))
   {
   	// SPLIT THE BLOCK
@@ -261,11 +480,34 @@ static void set_allocated(void *bp, size_t size)
   // IF WE DID NOT NEED TO SPLIT THE BLOCK
   else 
   {
-  	PUT(HDRP(bp), PACK(GET_SIZE(HDRP(bp)), 0x1, 0x2));
+  	PUT(HDRP(bp), PACK(size + extra_size, 0x1, 0x2));
   	PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 0x1, 0x2));
   }
 }
 
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes, carving all of them from
+ *     a single free block. Returns the number of blocks stored in out.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+  size_t new_size = ALIGN(size + BLOCK_OVERHEAD);
+  void *bp;
+
+  if (n == 0 || n > ((size_t)-1) / new_size)
+    return 0;
+
+  // FIND ONE EMPTY BLOCK THAT CAN HOLD THE WHOLE RUN
+  bp = find_fit(new_size * n);
+  if (bp == 0)
+  {
+    bp = extend(new_size * n);
+  }
+
+  set_allocated_run(bp, new_size, n, out);
+  return n;
+}
+
 /*
  * mm_free - Free a block and coalesce with empty blocks around it.
  */
@@ -274,6 +516,43 @@ void mm_free(void *bp)
   // DEALLOCATE THE BLOCK
   PUT(HDRP(bp), PACK(GET_SIZE(HDRP(bp)), 0x0, GET_PREV_ALLOC(HDRP(bp))));
 
+  release_block(bp);
+}
+
+/*
+ * mm_free_batch - Free n blocks. The pointers are sorted by address so that runs of
+ *     neighbouring blocks are merged and coalesced once. Reorders ptrs.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+  size_t i = 0, run_size;
+  void *start;
+
+  qsort(ptrs, n, sizeof(void *), compare_pointers);
+
+  while (i < n)
+  {
+    // EXTEND THE RUN WHILE THE NEXT POINTER IS THE NEXT BLOCK
+    start = ptrs[i];
+    run_size = GET_SIZE(HDRP(start));
+    while (i + 1 < n && ptrs[i + 1] == (char*)start + run_size)
+    {
+      i++;
+      run_size += GET_SIZE(HDRP(ptrs[i]));
+    }
+    i++;
+
+    // DEALLOCATE THE WHOLE RUN AS ONE BLOCK
+    PUT(HDRP(start), PACK(run_size, 0x0, GET_PREV_ALLOC(HDRP(start))));
+    release_block(start);
+  }
+}
+
+/*
+ * release_block - Give back a block whose header has been marked unallocated
+ */
+static void release_block(void *bp)
+{
   // BUILD A FOOTER
   PUT(FTRP(bp), PACK(GET_SIZE(HDRP(bp)), 0x0, GET_PREV_ALLOC(HDRP(bp))));
 
@@ -284,12 +563,18 @@ void mm_free(void *bp)
   PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 0x1, 0x0));
 
   // IF THIS IS THE ONLY BLOCK ON THE PAGE, ERASE THIS PAGE
-  if (GET_SIZE(NEXT_BLKP(bp)) == 0 && GET_PREV_ALLOC(PREV_BLKP_FTR(bp)) == 3)
+  if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0 && bp == PAGE_FIRST_BP(PAGE_OF_END(NEXT_BLKP(bp))))
   {
     remove_page_of_bp(bp);
   }
 }
 
+static int compare_pointers(const void *a, const void *b)
+{
+  char *x = *(char * const *)a, *y = *(char * const *)b;
+  return (x > y) - (x < y);
+}
+
 /*
  * mm_free - Coalesce a block with the unallocated blocks around it
  */
@@ -353,16 +638,25 @@ static void *coalesce(void *bp)
 }
 
 /*
- * mm_free - Perform a thorough check on the allocator, printing any errors that are encountered
+ * mm_check - Perform a thorough check on the allocator, returning the number of
+ *     errors that are encountered and printing each of them if verbose
  */
-static void checker()
+int mm_check(int verbose)
 {
-  // Check for two unallocated blocks in a row
+  int errors = 0;
+  size_t pages = 0, mapped = 0, free_bytes = 0, free_count = 0;
   void *bp;
   void *pp = first_page;
 
+  // No heap to check before mm_init or after mm_deinit
+  if (pp == NULL)
+    return 0;
+
   do 
   {
+    pages++;
+    mapped += PAGE_SIZE(pp);
+
     bp = PAGE_FIRST_BP(pp);
     // follow the path until we get to the page_footer block
     while (GET_SIZE(HDRP(bp)) != 0) 
@@ -370,13 +664,16 @@ static void checker()
       // if a block and it's neighbors are not allocated 
       if ((!GET_ALLOC(HDRP(bp)) && !GET_PREV_ALLOC(HDRP(bp))) || (!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp)))))
       {
-        printf("BAD_BLOCK: %p SIZE: %zu ALLOC: %zu:%zu\n", PREV_BLKP(bp), GET_SIZE(HDRP(PREV_BLKP(bp))), GET_PREV_ALLOC(HDRP(PREV_BLKP(bp))), GET_ALLOC(HDRP(PREV_BLKP(bp))));
-        printf("BAD_BLOCK: %p SIZE: %zu ALLOC: %zu:%zu\n", bp, GET_SIZE(HDRP(bp)), GET_PREV_ALLOC(HDRP(bp)), GET_ALLOC(HDRP(bp)));
-        printf("BAD_BLOCK: %p SIZE: %zu ALLOC: %zu:%zu\n", NEXT_BLKP(bp), GET_SIZE(HDRP(NEXT_BLKP(bp))), GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))), GET_ALLOC(HDRP(NEXT_BLKP(bp))));
-        printf("Two unallocated blocks in a row!\n");
+        errors++;
+        if (verbose)
+        {
+          printf("BAD_BLOCK: %p SIZE: %zu ALLOC: %zu:%zu\n", bp, GET_SIZE(HDRP(bp)), GET_PREV_ALLOC(HDRP(bp)), GET_ALLOC(HDRP(bp)));
+          printf("BAD_BLOCK: %p SIZE: %zu ALLOC: %zu:%zu\n", NEXT_BLKP(bp), GET_SIZE(HDRP(NEXT_BLKP(bp))), GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))), GET_ALLOC(HDRP(NEXT_BLKP(bp))));
+          printf("Two unallocated blocks in a row!\n");
+        }
       }
 
-      // if a block is not allocated and is not in the free list
+      // if a block is not allocated and is not in the free list or size tree
       if (!GET_ALLOC(HDRP(bp)))
       {
         int b = 1;
@@ -389,10 +686,27 @@ static void checker()
           }
           p = NEXT_FREE(p);
         }
+        p = tree_root;
+        while (p != 0)
+        {
+          if (p == bp)
+          {
+            b = 0;
+            break;
+          }
+          if (GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(p)) || (GET_SIZE(HDRP(bp)) == GET_SIZE(HDRP(p)) && (char*)bp < (char*)p))
+            p = TREE_LEFT(p);
+          else
+            p = TREE_RIGHT(p);
+        }
         if (b == 1)
         {
-          printf("An unallocated block is not in the free list!\n");
+          errors++;
+          if (verbose)
+            printf("An unallocated block is not in the free list!\n");
         }
+        free_bytes += GET_SIZE(HDRP(bp));
+        free_count++;
       }
       bp = NEXT_BLKP(bp);
     }
@@ -402,12 +716,86 @@ static void checker()
   void *p = last_freed;
   while (p != 0){
     if (GET_ALLOC(HDRP(p))){      
-      printf("A block in the free list is allocated!\n");
-      printf("BAD_BLOCK: %p SIZE: %zu ALLOC: %zu:%zu\n", bp, GET_SIZE(HDRP(bp)), GET_PREV_ALLOC(HDRP(bp)), GET_ALLOC(HDRP(bp)));
+      errors++;
+      if (verbose)
+      {
+        printf("A block in the free list is allocated!\n");
+        printf("BAD_BLOCK: %p SIZE: %zu ALLOC: %zu:%zu\n", p, GET_SIZE(HDRP(p)), GET_PREV_ALLOC(HDRP(p)), GET_ALLOC(HDRP(p)));
+      }
     }
     p = NEXT_FREE(p);
   }
 
+  // Check that the running totals agree with the heap
+  if (pages != pages_mapped || mapped != bytes_mapped)
+  {
+    errors++;
+    if (verbose)
+      printf("Page totals are off! PAGES: %zu:%zu BYTES: %zu:%zu\n", pages, pages_mapped, mapped, bytes_mapped);
+  }
+  if (free_count != free_blocks || free_bytes != bytes_free)
+  {
+    errors++;
+    if (verbose)
+      printf("Free totals are off! BLOCKS: %zu:%zu BYTES: %zu:%zu\n", free_count, free_blocks, free_bytes, bytes_free);
+  }
+
+  return errors;
+}
+
+/*
+ * mm_get_stats - Fill in a snapshot of the heap
+ */
+void mm_get_stats(mm_stats *stats)
+{
+  void *p;
+  size_t largest = 0;
+
+  if (first_page == NULL)
+  {
+    memset(stats, 0, sizeof(mm_stats));
+    return;
+  }
+
+  // The largest block is the only thing that isn't kept as we go.
+  // It is the rightmost block in the size tree, or if that is empty,
+  // somewhere in the free list of small blocks.
+  if (tree_root != 0)
+  {
+    for (p = tree_root; TREE_RIGHT(p) != 0; p = TREE_RIGHT(p))
+      ;
+    largest = GET_SIZE(HDRP(p));
+  }
+  else
+  {
+    for (p = last_freed; p != 0; p = NEXT_FREE(p))
+    {
+      if (GET_SIZE(HDRP(p)) > largest)
+        largest = GET_SIZE(HDRP(p));
+    }
+  }
+
+  stats->bytes_mapped = bytes_mapped + cached_bytes;
+  stats->bytes_in_use = bytes_mapped - bytes_free - pages_mapped*PAGE_OVERHEAD;
+  stats->bytes_free = bytes_free;
+  stats->free_blocks = free_blocks;
+  stats->largest_free = largest;
+  stats->pages = pages_mapped;
+  stats->cached_pages = cached_pages;
+  stats->cached_bytes = cached_bytes;
+  stats->fragmentation = bytes_free ? 1.0 - (double)largest / bytes_free : 0.0;
+  memcpy(stats->free_histogram, free_histogram, sizeof(free_histogram));
+}
+
+/*
+ * size_class - the histogram bucket for a block of the given size
+ */
+static int size_class(size_t size)
+{
+  int class = 0;
+  while ((size >>= 1) != 0 && class < MM_STATS_BUCKETS - 1)
+    class++;
+  return class;
 }
 
 /*
@@ -416,6 +804,16 @@ static void checker()
  */
 static void remove_block_from_free_list(void *bp)
 {
+  bytes_free -= GET_SIZE(HDRP(bp));
+  free_blocks--;
+  free_histogram[size_class(GET_SIZE(HDRP(bp)))]--;
+
+  if (GET_SIZE(HDRP(bp)) >= LARGE_BLOCK_SIZE)
+  {
+    tree_root = tree_remove(tree_root, bp);
+    return;
+  }
+
   if ((PREV_FREE(bp) == 0) && (NEXT_FREE(bp) == 0))
   {    
   	last_freed = 0;
@@ -441,6 +839,16 @@ static void remove_block_from_free_list(void *bp)
  */
 static void add_block_to_free_list(void *bp)
 {
+  bytes_free += GET_SIZE(HDRP(bp));
+  free_blocks++;
+  free_histogram[size_class(GET_SIZE(HDRP(bp)))]++;
+
+  if (GET_SIZE(HDRP(bp)) >= LARGE_BLOCK_SIZE)
+  {
+    tree_root = tree_insert(tree_root, bp);
+    return;
+  }
+
   if (last_freed == 0) 
   {
     NEXT_FREE(bp) = 0;
@@ -457,11 +865,169 @@ static void add_block_to_free_list(void *bp)
 }
 
 /*
- * remove_page_of_bp - Unmap pages used by allocator at given block pointer
+ * tree_less - true if block a comes before block b in the size tree, which is
+ *     ordered by size and then by address
+ */
+static int tree_less(void *a, void *b)
+{
+  return GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b))
+    || (GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (char*)a < (char*)b);
+}
+
+/*
+ * tree_update - recompute the height of a tree node from its children
+ */
+static void tree_update(void *n)
+{
+  long l = TREE_HEIGHT(TREE_LEFT(n)), r = TREE_HEIGHT(TREE_RIGHT(n));
+  ((tree_node*)n)->height = (l > r ? l : r) + 1;
+}
+
+static void *tree_rotate_right(void *n)
+{
+  void *l = TREE_LEFT(n);
+  TREE_LEFT(n) = TREE_RIGHT(l);
+  TREE_RIGHT(l) = n;
+  tree_update(n);
+  tree_update(l);
+  return l;
+}
+
+static void *tree_rotate_left(void *n)
+{
+  void *r = TREE_RIGHT(n);
+  TREE_RIGHT(n) = TREE_LEFT(r);
+  TREE_LEFT(r) = n;
+  tree_update(n);
+  tree_update(r);
+  return r;
+}
+
+/*
+ * tree_balance - restore the AVL balance of a node whose subtrees differ in
+ *     height by at most two, returning the new root of the subtree
+ */
+static void *tree_balance(void *n)
+{
+  long diff = TREE_HEIGHT(TREE_LEFT(n)) - TREE_HEIGHT(TREE_RIGHT(n));
+
+  if (diff > 1)
+  {
+    if (TREE_HEIGHT(TREE_LEFT(TREE_LEFT(n))) < TREE_HEIGHT(TREE_RIGHT(TREE_LEFT(n))))
+      TREE_LEFT(n) = tree_rotate_left(TREE_LEFT(n));
+    return tree_rotate_right(n);
+  }
+  if (diff < -1)
+  {
+    if (TREE_HEIGHT(TREE_RIGHT(TREE_RIGHT(n))) < TREE_HEIGHT(TREE_LEFT(TREE_RIGHT(n))))
+      TREE_RIGHT(n) = tree_rotate_right(TREE_RIGHT(n));
+    return tree_rotate_left(n);
+  }
+
+  tree_update(n);
+  return n;
+}
+
+/*
+ * tree_insert - add a large free block to the subtree at root, returning its new root
+ */
+static void *tree_insert(void *root, void *bp)
+{
+  if (root == 0)
+  {
+    TREE_LEFT(bp) = 0;
+    TREE_RIGHT(bp) = 0;
+    ((tree_node*)bp)->height = 1;
+    return bp;
+  }
+
+  if (tree_less(bp, root))
+    TREE_LEFT(root) = tree_insert(TREE_LEFT(root), bp);
+  else
+    TREE_RIGHT(root) = tree_insert(TREE_RIGHT(root), bp);
+
+  return tree_balance(root);
+}
+
+/*
+ * tree_remove_min - unlink the smallest block of the subtree at root into *min,
+ *     returning the subtree's new root
+ */
+static void *tree_remove_min(void *root, void **min)
+{
+  if (TREE_LEFT(root) == 0)
+  {
+    *min = root;
+    return TREE_RIGHT(root);
+  }
+
+  TREE_LEFT(root) = tree_remove_min(TREE_LEFT(root), min);
+  return tree_balance(root);
+}
+
+/*
+ * tree_remove - unlink a large free block from the subtree at root, returning its new root
+ */
+static void *tree_remove(void *root, void *bp)
+{
+  void *min;
+
+  if (root == 0)
+    return 0;
+
+  if (root != bp)
+  {
+    if (tree_less(bp, root))
+      TREE_LEFT(root) = tree_remove(TREE_LEFT(root), bp);
+    else
+      TREE_RIGHT(root) = tree_remove(TREE_RIGHT(root), bp);
+    return tree_balance(root);
+  }
+
+  // The block is this node, so splice in its successor
+  if (TREE_LEFT(bp) == 0)
+    return TREE_RIGHT(bp);
+  if (TREE_RIGHT(bp) == 0)
+    return TREE_LEFT(bp);
+
+  TREE_RIGHT(bp) = tree_remove_min(TREE_RIGHT(bp), &min);
+  TREE_LEFT(min) = TREE_LEFT(bp);
+  TREE_RIGHT(min) = TREE_RIGHT(bp);
+  return tree_balance(min);
+}
+
+/*
+ * tree_best_fit - the smallest large free block with at least size bytes,
+ *     or 0 if there isn't one
+ */
+static void *tree_best_fit(size_t size)
+{
+  void *n = tree_root, *fit = 0;
+
+  while (n != 0)
+  {
+    if (GET_SIZE(HDRP(n)) >= size)
+    {
+      fit = n;
+      n = TREE_LEFT(n);
+    }
+    else
+    {
+      n = TREE_RIGHT(n);
+    }
+  }
+
+  return fit;
+}
+
+/*
+ * remove_page_of_bp - Take the empty page at given block pointer out of the heap,
+ *     keeping it in the page cache if there is room for it
  */
 static void remove_page_of_bp(void *bp)
 {
   void *pp = ((char *)(bp) - PAGE_OVERHEAD + BLOCK_OVERHEAD);
+  size_t page_size = PAGE_SIZE(pp);
   if ((PAGE_PREV(pp) == 0) && (PAGE_NEXT(pp) == 0))
   {
     return;
@@ -480,5 +1046,160 @@ static void remove_page_of_bp(void *bp)
     PAGE_NEXT(PAGE_PREV(pp)) = PAGE_NEXT(pp);
     PAGE_PREV(PAGE_NEXT(pp)) = PAGE_PREV(pp);
   }
-  mem_unmap(pp, ((prolog*)(PAGE_PROLOG(first_page)))->page_size);
+  remove_block_from_free_list(bp);
+  pages_mapped--;
+  bytes_mapped -= page_size;
+
+  if (retain_max_pages == 0)
+  {
+    mem_unmap(pp, page_size);
+    return;
+  }
+
+  // Put the page at the front of the cache
+  CACHED_PAGE(pp)->emptied_at = now_ms();
+  CACHED_PAGE(pp)->advised = 0;
+  PAGE_PREV(pp) = 0;
+  PAGE_NEXT(pp) = cache_first;
+  if (cache_first != 0)
+    PAGE_PREV(cache_first) = pp;
+  else
+    cache_last = pp;
+  cache_first = pp;
+  cached_pages++;
+  cached_bytes += page_size;
+
+  decay_page_cache();
+}
+
+/*
+ * take_cached_page - Remove and return the newest cached page that can hold
+ *     size bytes, or NULL if there isn't one
+ */
+static void *take_cached_page(size_t size)
+{
+  void *pp;
+
+  for (pp = cache_first; pp != 0; pp = PAGE_NEXT(pp))
+  {
+    if (PAGE_SIZE(pp) >= size)
+      break;
+  }
+  if (pp == 0)
+    return NULL;
+
+  if (PAGE_PREV(pp) == 0)
+    cache_first = PAGE_NEXT(pp);
+  else
+    PAGE_NEXT(PAGE_PREV(pp)) = PAGE_NEXT(pp);
+  if (PAGE_NEXT(pp) == 0)
+    cache_last = PAGE_PREV(pp);
+  else
+    PAGE_PREV(PAGE_NEXT(pp)) = PAGE_PREV(pp);
+
+  cached_pages--;
+  cached_bytes -= PAGE_SIZE(pp);
+  return pp;
+}
+
+/*
+ * decay_page_cache - Unmap the oldest cached pages until the cache is within its limit,
+ *     then release any that have been empty for longer than the decay time. A released
+ *     page is either unmapped or, with madvise enabled, handed back to the kernel while
+ *     staying mapped until it is evicted.
+ */
+static void decay_page_cache(void)
+{
+  void *pp;
+  long now;
+
+  while (cached_pages > retain_max_pages)
+  {
+    pp = cache_last;
+    cache_last = PAGE_PREV(pp);
+    if (cache_last == 0)
+      cache_first = 0;
+    else
+      PAGE_NEXT(cache_last) = 0;
+    cached_pages--;
+    cached_bytes -= PAGE_SIZE(pp);
+    mem_unmap(pp, PAGE_SIZE(pp));
+  }
+
+  if (retain_decay_ms < 0)
+    return;
+
+  now = now_ms();
+  pp = cache_last;
+  while (pp != 0 && now - CACHED_PAGE(pp)->emptied_at >= retain_decay_ms)
+  {
+    void *newer = PAGE_PREV(pp);
+
+    if (retain_madvise)
+    {
+      // Keep the first OS page, which holds the page and cache headers
+      if (!CACHED_PAGE(pp)->advised)
+      {
+        madvise((char *)pp + mem_pagesize(), PAGE_SIZE(pp) - mem_pagesize(), MADV_DONTNEED);
+        CACHED_PAGE(pp)->advised = 1;
+      }
+    }
+    else
+    {
+      cache_last = newer;
+      if (newer == 0)
+        cache_first = 0;
+      else
+        PAGE_NEXT(newer) = 0;
+      cached_pages--;
+      cached_bytes -= PAGE_SIZE(pp);
+      mem_unmap(pp, PAGE_SIZE(pp));
+    }
+
+    pp = newer;
+  }
+}
+
+/*
+ * mm_set_page_retention - Configure the empty page cache
+ */
+void mm_set_page_retention(size_t max_pages, long decay_ms, int use_madvise)
+{
+  retain_max_pages = max_pages;
+  retain_decay_ms = decay_ms;
+  retain_madvise = use_madvise;
+  decay_page_cache();
+}
+
+/*
+ * mm_trim - Unmap every page in the page cache
+ */
+void mm_trim(void)
+{
+  void *pp, *next;
+
+  for (pp = cache_first; pp != 0; pp = next)
+  {
+    next = PAGE_NEXT(pp);
+    mem_unmap(pp, PAGE_SIZE(pp));
+  }
+
+  cache_first = 0;
+  cache_last = 0;
+  cached_pages = 0;
+  cached_bytes = 0;
+}
+
+/*
+ * now_ms - a cheap millisecond clock for aging cached pages
+ */
+static long now_ms(void)
+{
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
\ No newline at end of file
@@ -0,0 +1,88 @@
+/*
+ * mm.h - Interface to the page-based memory allocator in mm.c
+ */
+#ifndef MM_H
+#define MM_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int mm_init(void);
+void *mm_malloc(size_t size);
+void mm_free(void *ptr);
+
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes into out, carving them from a
+ *     single free region. Returns the number of blocks allocated.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/*
+ * mm_free_batch - Free n blocks, sorting ptrs by address so that neighbouring
+ *     blocks are coalesced once instead of one at a time.
+ */
+void mm_free_batch(void **ptrs, size_t n);
+
+/* Unmap every page of the heap; mm_init starts a fresh one */
+void mm_deinit(void);
+
+/* number of power-of-two buckets in the free block histogram */
+#define MM_STATS_BUCKETS 32
+
+/* A snapshot of the allocator's heap */
+typedef struct {
+  size_t bytes_mapped;   /* bytes currently mapped with mem_map, including cached pages */
+  size_t bytes_in_use;   /* bytes in allocated blocks, including block headers */
+  size_t bytes_free;     /* bytes in unallocated blocks */
+  size_t free_blocks;    /* number of unallocated blocks */
+  size_t largest_free;   /* size of the largest unallocated block */
+  size_t pages;          /* number of pages in use by the heap */
+  size_t cached_pages;   /* number of empty pages held for reuse */
+  size_t cached_bytes;   /* bytes in those pages */
+  double fragmentation;  /* 1 - largest_free / bytes_free, 0 when nothing is free */
+  /* free_histogram[i] counts the free blocks with a size in [2^i, 2^(i+1)) */
+  size_t free_histogram[MM_STATS_BUCKETS];
+} mm_stats;
+
+/*
+ * mm_get_stats - Fill in a snapshot of the heap. Everything except the
+ *     largest free block is kept up to date as blocks move on and off the
+ *     free list, so this only walks the free list.
+ */
+void mm_get_stats(mm_stats *stats);
+
+/*
+ * mm_set_page_retention - Keep up to max_pages empty pages mapped for reuse
+ *     instead of unmapping them as soon as they empty. Pages that have been
+ *     empty for decay_ms milliseconds (never, if negative) are released the
+ *     next time a page empties or the heap grows, or when mm_trim is called;
+ *     with use_madvise they are first returned to the kernel with
+ *     MADV_DONTNEED and only unmapped when the cache is full. max_pages of 0
+ *     unmaps empty pages right away, which is the default.
+ */
+void mm_set_page_retention(size_t max_pages, long decay_ms, int use_madvise);
+
+/* Unmap every empty page held in the page cache */
+void mm_trim(void);
+
+/*
+ * mm_set_huge_pages - When enabled, pages mapped from now on are rounded up to
+ *     2 MiB, aligned to 2 MiB and advised for transparent huge page backing.
+ *     Can be called before mm_init. Off by default.
+ */
+void mm_set_huge_pages(int enable);
+
+/*
+ * mm_check - Walk every page and block of the heap and validate it.
+ *     Returns the number of problems found, printing each one if verbose.
+ */
+int mm_check(int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * mm_bench.c - Replays allocation traces against mm.c and against the C
+ *     library's malloc, reporting throughput, peak mapped bytes, space
+ *     utilization and per-operation latency.
+ *
+ * Build together with mm.c and the mmap-based memlib.c:
+ *     cc -O2 -o mm_bench mm_bench.c mm.c memlib.c
+ *
+ * A trace is a text file with one operation per line:
+ *     a <id> <size>    allocate size bytes and name the block id
+ *     r <id> <size>    reallocate block id to size bytes
+ *     f <id>           free block id
+ * Any other line (the header lines of the course trace files, comments,
+ * blank lines) is skipped, so traces recorded from our services can be
+ * replayed as long as they use these three operations.
+ *
+ * traces/large-blocks.rep frees large blocks of mixed sizes around small
+ * ones and then refills the holes, which shows how well large requests fit:
+ *     ./mm_bench traces/large-blocks.rep
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* One operation from a trace */
+typedef struct {
+  char kind;
+  size_t id;
+  size_t size;
+} trace_op;
+
+/* A whole trace, loaded before anything is timed */
+typedef struct {
+  const char *name;
+  trace_op *ops;
+  size_t num_ops;
+  size_t num_ids;
+} trace;
+
+/* The functions being compared */
+typedef struct {
+  const char *name;
+  void (*init)(void);
+  void (*deinit)(void);
+  void *(*alloc)(size_t size);
+  void *(*realloc)(void *ptr, size_t old_size, size_t size);
+  void (*release)(void *ptr);
+  size_t (*mapped)(void);
+} allocator;
+
+/* What a run of a trace measured */
+typedef struct {
+  double seconds;
+  size_t peak_mapped;
+  size_t peak_live;
+  long *latencies;
+  int errors;
+} run_result;
+
+static trace *load_trace(const char *path);
+static void free_trace(trace *t);
+static void run_trace(trace *t, allocator *a, run_result *r);
+static void report(trace *t, allocator *a, run_result *r);
+static int compare_longs(const void *a, const void *b);
+static long now_ns(void);
+
+static void mm_bench_init(void);
+static void *mm_bench_realloc(void *ptr, size_t old_size, size_t size);
+static size_t mm_bench_mapped(void);
+static void libc_init(void);
+static void libc_deinit(void);
+static void *libc_realloc(void *ptr, size_t old_size, size_t size);
+static size_t libc_mapped(void);
+
+static allocator allocators[] = {
+  { "mm", mm_bench_init, mm_deinit, mm_malloc, mm_bench_realloc, mm_free, mm_bench_mapped },
+  { "libc", libc_init, libc_deinit, malloc, libc_realloc, free, libc_mapped },
+};
+
+/* run mm_check after each trace */
+static int check_heap;
+
+/* back the mm.c heap with huge pages */
+static int use_huge_pages;
+
+int main(int argc, char **argv)
+{
+  int opt, i, j, rep, repeats = 1;
+
+  while ((opt = getopt(argc, argv, "n:cH")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      repeats = atoi(optarg);
+      break;
+    case 'c':
+      check_heap = 1;
+      break;
+    case 'H':
+      use_huge_pages = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n <repeats>] [-c] [-H] <trace-file> ...\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  if (optind == argc || repeats < 1)
+  {
+    fprintf(stderr, "usage: %s [-n <repeats>] [-c] [-H] <trace-file> ...\n", argv[0]);
+    exit(1);
+  }
+
+  printf("%-20s %-6s %12s %12s %6s %8s %8s %8s %8s %8s\n",
+         "trace", "alloc", "ops/sec", "peak mapped", "util",
+         "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+
+  for (i = optind; i < argc; i++)
+  {
+    trace *t = load_trace(argv[i]);
+    if (t == NULL)
+      continue;
+
+    for (j = 0; j < (int)(sizeof(allocators) / sizeof(allocators[0])); j++)
+    {
+      for (rep = 0; rep < repeats; rep++)
+      {
+        run_result r;
+        run_trace(t, &allocators[j], &r);
+        report(t, &allocators[j], &r);
+        free(r.latencies);
+      }
+    }
+
+    free_trace(t);
+  }
+
+  return 0;
+}
+
+/*
+ * load_trace - read a trace file into memory, returning NULL if it can't be read
+ */
+static trace *load_trace(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  char line[256];
+  size_t capacity = 1024;
+  trace *t;
+
+  if (f == NULL)
+  {
+    perror(path);
+    return NULL;
+  }
+
+  t = malloc(sizeof(trace));
+  t->name = path;
+  t->ops = malloc(capacity * sizeof(trace_op));
+  t->num_ops = 0;
+  t->num_ids = 0;
+
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    trace_op op;
+    int fields;
+
+    if (line[0] == 'a' || line[0] == 'r')
+      fields = (sscanf(line + 1, "%zu %zu", &op.id, &op.size) == 2);
+    else if (line[0] == 'f')
+    {
+      fields = (sscanf(line + 1, "%zu", &op.id) == 1);
+      op.size = 0;
+    }
+    else
+      continue;
+
+    if (!fields)
+    {
+      fprintf(stderr, "%s: skipping bad line: %s", path, line);
+      continue;
+    }
+
+    op.kind = line[0];
+    if (t->num_ops == capacity)
+    {
+      capacity *= 2;
+      t->ops = realloc(t->ops, capacity * sizeof(trace_op));
+    }
+    t->ops[t->num_ops++] = op;
+    if (op.id + 1 > t->num_ids)
+      t->num_ids = op.id + 1;
+  }
+
+  fclose(f);
+  return t;
+}
+
+static void free_trace(trace *t)
+{
+  free(t->ops);
+  free(t);
+}
+
+/*
+ * run_trace - replay every operation of a trace, timing each one. The first
+ *     and last byte of each block are stamped with its id outside of the
+ *     timed region so that overlapping blocks show up as errors.
+ */
+static void run_trace(trace *t, allocator *a, run_result *r)
+{
+  void **blocks = calloc(t->num_ids, sizeof(void *));
+  size_t *sizes = calloc(t->num_ids, sizeof(size_t));
+  size_t live = 0, i;
+  long start, op_start;
+
+  r->latencies = malloc(t->num_ops * sizeof(long));
+  r->peak_live = 0;
+  r->peak_mapped = 0;
+  r->errors = 0;
+
+  a->init();
+  start = now_ns();
+
+  for (i = 0; i < t->num_ops; i++)
+  {
+    trace_op *op = &t->ops[i];
+    void *p = blocks[op->id];
+    unsigned char stamp = (unsigned char)op->id;
+
+    // Make sure the block we are about to touch wasn't clobbered
+    if (p != NULL && sizes[op->id] > 0
+        && (((unsigned char *)p)[0] != stamp || ((unsigned char *)p)[sizes[op->id] - 1] != stamp))
+      r->errors++;
+
+    op_start = now_ns();
+    if (op->kind == 'a')
+      p = a->alloc(op->size);
+    else if (op->kind == 'r')
+      p = (p == NULL) ? a->alloc(op->size) : a->realloc(p, sizes[op->id], op->size);
+    else if (p != NULL)
+      a->release(p);
+    r->latencies[i] = now_ns() - op_start;
+
+    if (op->kind == 'f')
+    {
+      live -= sizes[op->id];
+      blocks[op->id] = NULL;
+      sizes[op->id] = 0;
+    }
+    else
+    {
+      live += op->size - sizes[op->id];
+      blocks[op->id] = p;
+      sizes[op->id] = op->size;
+      if (op->size > 0)
+      {
+        ((unsigned char *)p)[0] = stamp;
+        ((unsigned char *)p)[op->size - 1] = stamp;
+      }
+    }
+
+    if (live > r->peak_live)
+      r->peak_live = live;
+
+    // Sampling the C library is slow, so only do it now and then
+    if (a->mapped != libc_mapped || (i & 0xFF) == 0)
+    {
+      size_t mapped = a->mapped();
+      if (mapped > r->peak_mapped)
+        r->peak_mapped = mapped;
+    }
+  }
+
+  r->seconds = (now_ns() - start) / 1e9;
+
+  if (a->mapped == mm_bench_mapped)
+  {
+    r->peak_mapped = mem_peak_heapsize();
+    if (check_heap)
+      r->errors += mm_check(1);
+  }
+
+  for (i = 0; i < t->num_ids; i++)
+  {
+    if (blocks[i] != NULL)
+      a->release(blocks[i]);
+  }
+  a->deinit();
+
+  free(blocks);
+  free(sizes);
+}
+
+/*
+ * report - print one line of results for a run
+ */
+static void report(trace *t, allocator *a, run_result *r)
+{
+  size_t n = t->num_ops;
+  double util = r->peak_mapped ? (double)r->peak_live / r->peak_mapped : 0.0;
+
+  qsort(r->latencies, n, sizeof(long), compare_longs);
+
+  printf("%-20s %-6s %12.0f %12zu %5.1f%% %8ld %8ld %8ld %8ld %8ld%s\n",
+         t->name, a->name,
+         r->seconds > 0 ? n / r->seconds : 0.0,
+         r->peak_mapped, util * 100.0,
+         n ? r->latencies[n / 2] : 0,
+         n ? r->latencies[n * 90 / 100] : 0,
+         n ? r->latencies[n * 99 / 100] : 0,
+         n ? r->latencies[n * 999 / 1000] : 0,
+         n ? r->latencies[n - 1] : 0,
+         r->errors ? "  ERRORS" : "");
+}
+
+static int compare_longs(const void *a, const void *b)
+{
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+static long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void mm_bench_init(void)
+{
+  mm_set_huge_pages(use_huge_pages);
+  mem_reset_peak();
+  mm_init();
+}
+
+/*
+ * mm_bench_realloc - mm.c has no realloc, so move the block by hand
+ */
+static void *mm_bench_realloc(void *ptr, size_t old_size, size_t size)
+{
+  void *p = mm_malloc(size);
+  memcpy(p, ptr, old_size < size ? old_size : size);
+  mm_free(ptr);
+  return p;
+}
+
+static size_t mm_bench_mapped(void)
+{
+  return mem_heapsize();
+}
+
+static void libc_init(void)
+{
+}
+
+static void libc_deinit(void)
+{
+  malloc_trim(0);
+}
+
+static void *libc_realloc(void *ptr, size_t old_size, size_t size)
+{
+  return realloc(ptr, size);
+}
+
+/*
+ * libc_mapped - bytes the C library has taken from the OS for its heap
+ */
+static size_t libc_mapped(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+  return mi.arena + mi.hblkhd;
+#else
+  return 0;
+#endif
+}
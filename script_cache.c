@@ -0,0 +1,549 @@
+/*
+ * script_cache.c - Saves each parsed script as one relocatable image, so that
+ *     later runs of an unchanged script skip the parser.
+ *
+ * A cache file is a header, the absolute path of the script, and the image:
+ * the script, its groups, commands, arguments, variables and strings laid out
+ * as the structs from ast.h, with every pointer stored as its offset in the
+ * image plus one (0 for NULL). Loading maps the whole file once and adds the
+ * image's address to each pointer, checking every offset on the way, after
+ * checking the image against its hash, since a corrupted count can be as
+ * harmful as a corrupted pointer. Only the fields whoosh knows about are
+ * kept; any others are left zeroed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ast.h"
+#include "script_cache.h"
+
+#define CACHE_MAGIC "WHOOSHC1"
+#define CACHE_VERSION 2
+
+/* every struct in an image starts at a multiple of this */
+#define IMAGE_ALIGN 16
+
+/* Round n up to a multiple of IMAGE_ALIGN */
+#define ALIGN(n) (((n) + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1))
+
+/* The start of a cache file */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  /* sizes of the ast.h structs the image was laid out with */
+  uint32_t struct_sizes[5];
+  /* the script as it was when it was parsed */
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t size;
+  uint64_t hash;
+  uint64_t path_len;
+  /* where the image is in the file, its size, and a hash of it */
+  uint64_t image_offset;
+  uint64_t image_size;
+  uint64_t image_hash;
+  /* variables are shared between commands, so they have an array of their own */
+  uint64_t num_vars;
+  uint64_t vars_offset;
+} cache_header;
+
+/* An image being built */
+typedef struct {
+  char *data;
+  size_t size;
+  size_t capacity;
+  script_var **vars;   /* the parsed variables, in the order of the image's array */
+  size_t num_vars;
+  size_t vars_offset;
+} image;
+
+static int cache_file_name(const char *path, char *name, size_t n);
+static uint64_t hash_bytes(const unsigned char *p, size_t n, uint64_t h);
+static int hash_script(const char *filename, struct stat *st, uint64_t *hash);
+static void fill_sizes(uint32_t *sizes);
+static script *load_cache(const char *name, const char *path, struct stat *st, uint64_t hash);
+static void save_cache(const char *name, const char *path, struct stat *st, uint64_t hash,
+                       script *scr);
+static int relocate(void *field, char *base, size_t size, size_t count, size_t elem_size);
+static int relocate_string(const char **field, char *base, size_t size);
+static int relocate_var(script_var **field, char *base, cache_header *h);
+static void build_image(image *img, script *scr);
+static size_t image_reserve(image *img, size_t size, size_t align);
+static size_t image_string(image *img, const char *s);
+static size_t image_var(image *img, script_var *var);
+static void collect_var(image *img, script_var *var, size_t *capacity);
+
+script *parse_script_cached(const char *filename) {
+  char path[PATH_MAX], name[PATH_MAX];
+  struct stat st;
+  uint64_t hash;
+  script *scr;
+
+  if (filename == NULL
+      || realpath(filename, path) == NULL
+      || !cache_file_name(path, name, sizeof(name))
+      || !hash_script(filename, &st, &hash))
+    return parse_script_file(filename);
+
+  if ((scr = load_cache(name, path, &st, hash)) != NULL)
+    return scr;
+
+  scr = parse_script_file(filename);
+  save_cache(name, path, &st, hash, scr);
+  return scr;
+}
+
+/*
+ * cache_file_name - picks the cache file for the script at path, creating its
+ * directory if need be. Returns 0 if caching is off or there is nowhere to cache.
+ */
+static int cache_file_name(const char *path, char *name, size_t n) {
+  const char *dir = getenv("WHOOSH_CACHE_DIR"), *base;
+  char parent[PATH_MAX];
+  int len, dir_len;
+
+  if (dir != NULL){
+    if (*dir == '\0')
+      return 0;
+    len = snprintf(name, n, "%s", dir);
+  }
+  else if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base != '\0')
+    len = snprintf(name, n, "%s/whoosh", base);
+  else if ((base = getenv("HOME")) != NULL && *base != '\0'){
+    snprintf(parent, sizeof(parent), "%s/.cache", base);
+    mkdir(parent, 0700);
+    len = snprintf(name, n, "%s/whoosh", parent);
+  }
+  else
+    return 0;
+
+  if (len < 0 || (size_t)len >= n)
+    return 0;
+  mkdir(name, 0700);
+
+  // Name the file after a hash of the path; the header holds the path itself
+  dir_len = len;
+  len = snprintf(name + dir_len, n - dir_len, "/%016llx.whc",
+                 (unsigned long long)hash_bytes((const unsigned char *)path, strlen(path), 0));
+  return len > 0 && (size_t)len < n - dir_len;
+}
+
+/*
+ * hash_bytes - 64-bit FNV-1a, continuing from h (0 to start)
+ */
+static uint64_t hash_bytes(const unsigned char *p, size_t n, uint64_t h) {
+  size_t i;
+
+  if (h == 0)
+    h = 0xcbf29ce484222325ULL;
+  for (i = 0; i < n; i++){
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/*
+ * hash_script - stats the script and hashes its contents
+ */
+static int hash_script(const char *filename, struct stat *st, uint64_t *hash) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  void *p;
+
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)){
+    close(fd);
+    return 0;
+  }
+
+  *hash = hash_bytes(NULL, 0, 0);
+  if (st->st_size > 0){
+    p = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED){
+      close(fd);
+      return 0;
+    }
+    *hash = hash_bytes(p, st->st_size, *hash);
+    munmap(p, st->st_size);
+  }
+
+  close(fd);
+  return 1;
+}
+
+static void fill_sizes(uint32_t *sizes) {
+  sizes[0] = sizeof(script);
+  sizes[1] = sizeof(script_group);
+  sizes[2] = sizeof(script_command);
+  sizes[3] = sizeof(script_argument);
+  sizes[4] = sizeof(script_var);
+}
+
+/*
+ * load_cache - maps the cache file and relocates its image in place, returning
+ * NULL if there is no usable cache for this version of the script. The
+ * mapping is never unmapped, since the script lives as long as whoosh does.
+ */
+static script *load_cache(const char *name, const char *path, struct stat *st, uint64_t hash) {
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  struct stat cache_st;
+  cache_header *h;
+  uint32_t sizes[5];
+  char *file, *base;
+  size_t size, i;
+  int g, c, a, ok;
+  script *scr;
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &cache_st) < 0 || (size_t)cache_st.st_size < sizeof(cache_header)){
+    close(fd);
+    return NULL;
+  }
+
+  // One private, writable mapping: relocation only dirties the pages it touches
+  file = mmap(NULL, cache_st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED)
+    return NULL;
+
+  h = (cache_header *)file;
+  fill_sizes(sizes);
+  if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0
+      || h->version != CACHE_VERSION
+      || memcmp(h->struct_sizes, sizes, sizeof(sizes)) != 0
+      || h->mtime_sec != st->st_mtim.tv_sec
+      || h->mtime_nsec != st->st_mtim.tv_nsec
+      || h->size != (uint64_t)st->st_size
+      || h->hash != hash
+      || h->path_len != strlen(path)
+      || sizeof(cache_header) + h->path_len > h->image_offset
+      || h->image_offset % IMAGE_ALIGN != 0
+      || h->image_size < sizeof(script) + 1
+      || h->image_offset + h->image_size != (uint64_t)cache_st.st_size
+      || memcmp(file + sizeof(cache_header), path, h->path_len) != 0)
+    goto fail;
+
+  base = file + h->image_offset;
+  size = h->image_size;
+
+  // The image ends in a NUL, so every string in it ends inside it
+  if (base[size - 1] != '\0'
+      || hash_bytes((const unsigned char *)base, size, 0) != h->image_hash)
+    goto fail;
+
+  scr = (script *)base;
+  if (scr->num_groups < 0
+      || !relocate(&scr->groups, base, size, scr->num_groups, sizeof(script_group))
+      || h->vars_offset % IMAGE_ALIGN != 0
+      || h->vars_offset + h->num_vars * sizeof(script_var) > size)
+    goto fail;
+
+  for (i = 0; i < h->num_vars; i++){
+    script_var *var = (script_var *)(base + h->vars_offset) + i;
+    if (!relocate_string(&var->name, base, size) || !relocate_string(&var->value, base, size))
+      goto fail;
+  }
+
+  for (g = 0; g < scr->num_groups; g++){
+    script_group *group = &scr->groups[g];
+    if (group->num_commands < 0
+        || !relocate(&group->commands, base, size, group->num_commands, sizeof(script_command))
+        || !relocate_var(&group->result_to, base, h))
+      goto fail;
+
+    for (c = 0; c < group->num_commands; c++){
+      script_command *command = &group->commands[c];
+      if (command->num_arguments < 0
+          || !relocate_string(&command->program, base, size)
+          || !relocate(&command->arguments, base, size, command->num_arguments,
+                       sizeof(script_argument))
+          || !relocate_var(&command->pid_to, base, h))
+        goto fail;
+
+      for (a = 0; a < command->num_arguments; a++){
+        script_argument *arg = &command->arguments[a];
+        ok = (arg->kind == ARGUMENT_LITERAL) ? relocate_string(&arg->u.literal, base, size)
+                                             : relocate_var(&arg->u.var, base, h);
+        if (!ok)
+          goto fail;
+      }
+    }
+  }
+
+  // set_var frees a variable's old value, so each one needs its own copy
+  for (i = 0; i < h->num_vars; i++){
+    script_var *var = (script_var *)(base + h->vars_offset) + i;
+    if (var->value != NULL)
+      var->value = strdup(var->value);
+  }
+
+  return scr;
+
+ fail:
+  munmap(file, cache_st.st_size);
+  return NULL;
+}
+
+/*
+ * relocate - turns the stored offset in the pointer at field into an address
+ * in base, checking that count elements of elem_size fit in the image there
+ */
+static int relocate(void *field, char *base, size_t size, size_t count, size_t elem_size) {
+  uintptr_t offset = *(uintptr_t *)field;
+
+  if (offset == 0)
+    return count == 0;
+  offset--;
+  if (offset % IMAGE_ALIGN != 0 || offset > size || count > (size - offset) / elem_size)
+    return 0;
+  *(void **)field = base + offset;
+  return 1;
+}
+
+static int relocate_string(const char **field, char *base, size_t size) {
+  uintptr_t offset = *(uintptr_t *)field;
+
+  if (offset == 0)
+    return 1;
+  if (offset - 1 >= size)
+    return 0;
+  *field = base + offset - 1;
+  return 1;
+}
+
+/*
+ * relocate_var - like relocate, but the variable has to be one of the
+ * entries of the image's variable array
+ */
+static int relocate_var(script_var **field, char *base, cache_header *h) {
+  uintptr_t offset = *(uintptr_t *)field;
+
+  if (offset == 0)
+    return 1;
+  offset--;
+  if (offset < h->vars_offset || (offset - h->vars_offset) % sizeof(script_var) != 0
+      || (offset - h->vars_offset) / sizeof(script_var) >= h->num_vars)
+    return 0;
+  *field = (script_var *)(base + offset);
+  return 1;
+}
+
+/*
+ * save_cache - writes the image of a freshly parsed script to its cache file.
+ * The file is written under a temporary name and renamed into place, so a
+ * whoosh running the same script at the same time never sees half of it. The
+ * cache directory may be shared, so the temporary file has to be new rather
+ * than anything already there under its name, a symlink least of all.
+ */
+static void save_cache(const char *name, const char *path, struct stat *st, uint64_t hash,
+                       script *scr) {
+  char tmp_name[PATH_MAX];
+  cache_header h;
+  image img;
+  size_t path_len = strlen(path);
+  static const char zeros[IMAGE_ALIGN];
+  FILE *f;
+  int fd, ok;
+
+  if ((size_t)snprintf(tmp_name, sizeof(tmp_name), "%s.%d", name, (int)getpid()) >= sizeof(tmp_name))
+    return;
+
+  build_image(&img, scr);
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+  h.version = CACHE_VERSION;
+  fill_sizes(h.struct_sizes);
+  h.mtime_sec = st->st_mtim.tv_sec;
+  h.mtime_nsec = st->st_mtim.tv_nsec;
+  h.size = st->st_size;
+  h.hash = hash;
+  h.path_len = path_len;
+  h.image_offset = ALIGN(sizeof(h) + path_len);
+  h.image_size = img.size;
+  h.image_hash = hash_bytes((const unsigned char *)img.data, img.size, 0);
+  h.num_vars = img.num_vars;
+  h.vars_offset = img.vars_offset;
+
+  if ((fd = open(tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) >= 0
+      && (f = fdopen(fd, "wb")) != NULL){
+    ok = fwrite(&h, sizeof(h), 1, f) == 1
+         && fwrite(path, 1, path_len, f) == path_len
+         && fwrite(zeros, 1, h.image_offset - sizeof(h) - path_len, f)
+            == h.image_offset - sizeof(h) - path_len
+         && fwrite(img.data, 1, img.size, f) == img.size;
+    if (fclose(f) != 0 || !ok || rename(tmp_name, name) != 0)
+      unlink(tmp_name);
+  }
+  else if (fd >= 0){
+    close(fd);
+    unlink(tmp_name);
+  }
+
+  free(img.data);
+  free(img.vars);
+}
+
+/*
+ * build_image - lays out the script as an image in img. The script comes
+ * first, then its variable array, then each group's commands followed by
+ * their arguments and strings. The image ends in a NUL byte.
+ */
+static void build_image(image *img, script *scr) {
+  size_t scr_off, groups_off, commands_off, args_off, i, capacity = 0;
+  int g, c, a;
+
+  img->data = NULL;
+  img->size = img->capacity = 0;
+  img->vars = NULL;
+  img->num_vars = 0;
+
+  // Find every variable once, since commands share them by pointer
+  for (g = 0; g < scr->num_groups; g++){
+    script_group *group = &scr->groups[g];
+    collect_var(img, group->result_to, &capacity);
+    for (c = 0; c < group->num_commands; c++){
+      script_command *command = &group->commands[c];
+      collect_var(img, command->pid_to, &capacity);
+      for (a = 0; a < command->num_arguments; a++){
+        if (command->arguments[a].kind != ARGUMENT_LITERAL)
+          collect_var(img, command->arguments[a].u.var, &capacity);
+      }
+    }
+  }
+
+  scr_off = image_reserve(img, sizeof(script), IMAGE_ALIGN);
+  img->vars_offset = image_reserve(img, img->num_vars * sizeof(script_var), IMAGE_ALIGN);
+  for (i = 0; i < img->num_vars; i++){
+    size_t name = image_string(img, img->vars[i]->name);
+    size_t value = image_string(img, img->vars[i]->value);
+    script_var *var = (script_var *)(img->data + img->vars_offset) + i;
+    var->name = (const char *)name;
+    var->value = (const char *)value;
+  }
+
+  groups_off = image_reserve(img, scr->num_groups * sizeof(script_group), IMAGE_ALIGN);
+  ((script *)(img->data + scr_off))->num_groups = scr->num_groups;
+  ((script *)(img->data + scr_off))->groups = (script_group *)(scr->num_groups ? groups_off + 1 : 0);
+
+  for (g = 0; g < scr->num_groups; g++){
+    script_group *group = &scr->groups[g];
+    commands_off = image_reserve(img, group->num_commands * sizeof(script_command), IMAGE_ALIGN);
+    {
+      script_group *out = (script_group *)(img->data + groups_off) + g;
+      out->mode = group->mode;
+      out->repeats = group->repeats;
+      out->num_commands = group->num_commands;
+      out->commands = (script_command *)(group->num_commands ? commands_off + 1 : 0);
+      out->result_to = (script_var *)image_var(img, group->result_to);
+    }
+
+    for (c = 0; c < group->num_commands; c++){
+      script_command *command = &group->commands[c];
+      size_t program = image_string(img, command->program);
+      args_off = image_reserve(img, command->num_arguments * sizeof(script_argument), IMAGE_ALIGN);
+      {
+        script_command *out = (script_command *)(img->data + commands_off) + c;
+        out->program = (const char *)program;
+        out->num_arguments = command->num_arguments;
+        out->arguments = (script_argument *)(command->num_arguments ? args_off + 1 : 0);
+        out->pid_to = (script_var *)image_var(img, command->pid_to);
+      }
+
+      for (a = 0; a < command->num_arguments; a++){
+        script_argument *arg = &command->arguments[a];
+        size_t value = (arg->kind == ARGUMENT_LITERAL) ? image_string(img, arg->u.literal)
+                                                       : image_var(img, arg->u.var);
+        script_argument *out = (script_argument *)(img->data + args_off) + a;
+        out->kind = arg->kind;
+        if (arg->kind == ARGUMENT_LITERAL)
+          out->u.literal = (const char *)value;
+        else
+          out->u.var = (script_var *)value;
+      }
+    }
+  }
+
+  image_reserve(img, 1, 1);
+}
+
+/*
+ * image_reserve - adds size zeroed bytes at the given alignment to the image,
+ * returning their offset. The image may move, so callers hold on to offsets.
+ */
+static size_t image_reserve(image *img, size_t size, size_t align) {
+  size_t offset = (img->size + align - 1) & ~(align - 1);
+
+  if (offset + size > img->capacity){
+    size_t capacity = img->capacity ? img->capacity : 1024;
+    while (offset + size > capacity)
+      capacity *= 2;
+    img->data = realloc(img->data, capacity);
+    if (img->data == NULL){
+      perror("script cache");
+      exit(1);
+    }
+    img->capacity = capacity;
+  }
+
+  memset(img->data + img->size, 0, offset + size - img->size);
+  img->size = offset + size;
+  return offset;
+}
+
+/*
+ * image_string - copies s into the image, returning its stored offset
+ */
+static size_t image_string(image *img, const char *s) {
+  size_t len, offset;
+
+  if (s == NULL)
+    return 0;
+  len = strlen(s) + 1;
+  offset = image_reserve(img, len, 1);
+  memcpy(img->data + offset, s, len);
+  return offset + 1;
+}
+
+/*
+ * image_var - the stored offset of a variable's entry in the image's array
+ */
+static size_t image_var(image *img, script_var *var) {
+  size_t i;
+
+  if (var == NULL)
+    return 0;
+  for (i = 0; img->vars[i] != var; i++)
+    ;
+  return img->vars_offset + i * sizeof(script_var) + 1;
+}
+
+static void collect_var(image *img, script_var *var, size_t *capacity) {
+  size_t i;
+
+  if (var == NULL)
+    return;
+  for (i = 0; i < img->num_vars; i++){
+    if (img->vars[i] == var)
+      return;
+  }
+
+  if (img->num_vars == *capacity){
+    *capacity = *capacity ? 2 * *capacity : 16;
+    img->vars = realloc(img->vars, *capacity * sizeof(script_var *));
+    if (img->vars == NULL){
+      perror("script cache");
+      exit(1);
+    }
+  }
+  img->vars[img->num_vars++] = var;
+}
@@ -0,0 +1,20 @@
+/*
+ * script_cache.h - Cached parsed scripts for whoosh
+ */
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+/* ast.h has to be included first */
+
+/*
+ * parse_script_cached - parse_script_file, but a script that has been parsed
+ *     before is loaded from its cache file instead. A cache file belongs to a
+ *     script path and is only used while the script's mtime, size and content
+ *     hash still match. Cache files live in $WHOOSH_CACHE_DIR, else
+ *     $XDG_CACHE_HOME/whoosh, else ~/.cache/whoosh; setting WHOOSH_CACHE_DIR
+ *     to the empty string turns caching off. A script read from stdin
+ *     (filename NULL) is never cached.
+ */
+script *parse_script_cached(const char *filename);
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * server_log.c - A log that any number of threads add lines to and one
+ *     thread writes out.
+ *
+ * Lines go in a ring of slots, each with a sequence number saying whose turn
+ * it is: a slot whose number equals a writer's position is free for that
+ * writer, and one whose number is one past the reader's position holds the
+ * reader's next line. A writer claims a position by advancing tail with a
+ * compare-and-swap, fills the slot and then publishes it by bumping its
+ * number; the reader takes lines in order and hands each slot on to the
+ * writer one lap later. A writer that finds its slot still a lap behind
+ * knows the ring is full and drops its line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "server_log.h"
+
+/* Lines the ring holds, a power of two */
+#define LOG_SLOTS 4096
+
+/* Most bytes of a line, with its newline */
+#define LOG_LINE_MAX 512
+
+/* How long the writer sleeps when the ring is empty, in nanoseconds */
+#define FLUSH_INTERVAL 10000000
+
+typedef struct {
+  size_t seq;
+  int level;
+  int len;
+  char text[LOG_LINE_MAX];
+} slot;
+
+static slot ring[LOG_SLOTS];
+/* The next position a writer will claim; the reader's is its own */
+static size_t tail;
+static size_t dropped;
+/* Whether the ring's sequence numbers have been set up */
+static int ring_ready;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+int server_log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+
+static void init_ring(void);
+static void *flush_thread(void *arg);
+
+void server_log_write(int level, const char *fmt, ...) {
+  size_t pos, seq;
+  slot *s;
+  va_list ap;
+  int n;
+
+  if (!__atomic_load_n(&ring_ready, __ATOMIC_ACQUIRE))
+    pthread_once(&ring_once, init_ring);
+
+  pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  for (;;) {
+    s = &ring[pos & (LOG_SLOTS - 1)];
+    seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if ((long)(seq - pos) < 0) {
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else
+      pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  }
+
+  va_start(ap, fmt);
+  n = vsnprintf(s->text, LOG_LINE_MAX - 1, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    n = 0;
+  else if (n >= LOG_LINE_MAX - 1) {
+    n = LOG_LINE_MAX - 2;
+    memcpy(s->text + n - 3, "...", 3);
+  }
+  s->text[n++] = '\n';
+  s->len = n;
+  s->level = level;
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void server_log_start(void) {
+  pthread_t th;
+
+  pthread_once(&ring_once, init_ring);
+  pthread_create(&th, NULL, flush_thread, NULL);
+  pthread_detach(th);
+}
+
+int server_log_parse_level(const char *name) {
+  int i;
+
+  for (i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++) {
+    if (!strcasecmp(name, level_names[i]))
+      return i;
+  }
+  return -1;
+}
+
+size_t server_log_dropped(void) {
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+static void init_ring(void) {
+  size_t i;
+
+  for (i = 0; i < LOG_SLOTS; i++)
+    ring[i].seq = i;
+  __atomic_store_n(&ring_ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * flush_thread - writes out lines as they are published, flushing whenever
+ *     it catches up, and says so when lines have been dropped
+ */
+static void *flush_thread(void *arg) {
+  struct timespec interval = { 0, FLUSH_INTERVAL };
+  size_t head = 0, reported = 0, now_dropped;
+  slot *s;
+
+  for (;;) {
+    s = &ring[head & (LOG_SLOTS - 1)];
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == head + 1) {
+      // Keep lines in order where both streams go to the same place
+      if (s->level <= LOG_LEVEL_WARN) {
+        fflush(stdout);
+        fwrite(s->text, 1, s->len, stderr);
+      }
+      else
+        fwrite(s->text, 1, s->len, stdout);
+      __atomic_store_n(&s->seq, head + LOG_SLOTS, __ATOMIC_RELEASE);
+      head++;
+      continue;
+    }
+
+    fflush(stdout);
+    if ((now_dropped = server_log_dropped()) != reported) {
+      fprintf(stderr, "server_log: dropped %zu lines for want of room\n",
+              now_dropped - reported);
+      reported = now_dropped;
+    }
+    nanosleep(&interval, NULL);
+  }
+  return NULL;
+}
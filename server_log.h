@@ -0,0 +1,58 @@
+/*
+ * server_log.h - Logging for servers that can't wait on their output
+ */
+#ifndef SERVER_LOG_H
+#define SERVER_LOG_H
+
+#include <stddef.h>
+
+/* How much to log, from least to most. Errors and warnings go to stderr,
+   the rest to stdout. */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/* Lines above this level are skipped; LOG_LEVEL_INFO to begin with */
+extern int server_log_level;
+
+/*
+ * server_log - logs a line (with no newline) if level is being logged. The
+ *     arguments aren't even evaluated if it isn't, so a line that is costly
+ *     to make can be left in.
+ */
+#define server_log(level, ...) \
+  do { \
+    if (server_log_enabled(level)) \
+      server_log_write((level), __VA_ARGS__); \
+  } while (0)
+
+#define server_log_enabled(level) ((level) <= server_log_level)
+
+/*
+ * server_log_write - logs a line whatever the level. It is formatted straight
+ *     into a slot of a fixed ring, without locking, and a thread started by
+ *     server_log_start writes it out later. If the ring is full the line is
+ *     dropped, so logging never blocks. Lines too long for a slot are cut
+ *     short.
+ */
+void server_log_write(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/*
+ * server_log_start - starts writing out logged lines, including any logged
+ *     before it was called
+ */
+void server_log_start(void);
+
+/*
+ * server_log_parse_level - the level named error, warn, info or debug, or -1
+ */
+int server_log_parse_level(const char *name);
+
+/*
+ * server_log_dropped - how many lines have been dropped for want of room
+ */
+size_t server_log_dropped(void);
+
+#endif
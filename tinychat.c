@@ -8,181 +8,1256 @@
  *   Dave O'Hallaron
  *   Carnegie Mellon University
  */
+#define _GNU_SOURCE
 #include "csapp.h"
 #include "dictionary.h"
 #include "more_string.h"
+#include "topic_store.h"
+#include "topic_wal.h"
+#include "server_log.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+/* Most bytes of request line and headers we will buffer for one request */
+#define MAX_REQUEST_HEADER 65536
+
+/* Most bytes of request body we will accept */
+#define MAX_REQUEST_BODY (1 << 20)
+
+/* Bytes to read from a connection at a time */
+#define READ_SIZE 16384
+
+/* Most events to take from epoll at once */
+#define MAX_EVENTS 256
+
+/* Pipelined responses are sent once this many bytes are waiting */
+#define FLUSH_SIZE 65536
+
+/* Most segments of a response to send with one writev */
+#define MAX_IOVECS 64
+
+/* Shorter constant strings are copied into a response rather than borrowed */
+#define BORROW_MIN 256
+
+/* Most requests a worker handles on one connection before giving others a turn */
+#define MAX_REQUESTS_PER_TURN 64
+
+/* Seconds a connection may sit between requests, and in the middle of one */
+#define IDLE_TIMEOUT 15
+#define REQUEST_TIMEOUT 30
+
+/* Most seconds a long poll may wait for a message */
+#define MAX_WAIT 60
+
+/* Where a connection is in a long poll */
+#define WAIT_NONE 0
+#define WAIT_PARKED 1     /* in its topic's waiters, owned by no thread */
+#define WAIT_WOKEN 2      /* claimed by a new message */
+#define WAIT_TIMED_OUT 3  /* claimed by the sweep, still in the waiters */
+
+/* What /stats counts requests under */
+#define ROUTE_FORM 0          /* GET / */
+#define ROUTE_CONVERSATION 1  /* GET /conversation */
+#define ROUTE_SINCE 2         /* GET /conversation?since= */
+#define ROUTE_WAIT 3          /* GET /conversation?since=&wait= */
+#define ROUTE_SAY 4           /* GET /say */
+#define ROUTE_POST 5          /* POST /conversation */
+#define ROUTE_STATS 6         /* GET /stats */
+#define ROUTE_ERROR 7         /* anything answered with an error */
+#define NUM_ROUTES 8
+
+/* /stats sorts how long requests took by powers of two: bucket i counts
+   those answered in under 2^i microseconds, the last bucket any slower */
+#define LATENCY_BUCKETS 28
+
+/* The start of every conversation page, up to its topic */
+#define PAGE_HEAD \
+  "<html><style>" \
+  "body { background-color: #ffc805}" \
+  "h1 { color: #111; font-family: 'Open Sans', sans-serif; font-size: 30px; font-weight: 700; line-height: 32px; margin: 0 0 72px; text-align: center; }" \
+  "p { color: #685206; font-family: 'Helvetica Neue', sans-serif; font-size: 14px; font-weight: 700; line-height: 24px; margin: 0 0 24px; text-align: justify; text-justify: inter-word; }" \
+  "</style><body>\r\n"
+
+/* The rest of a conversation page, around its topic, its messages and the
+   name of whoever is looking at it */
+#define PAGE_FORM \
+  "</h1>" \
+  "\r\n<form action=\"conversation\" method=\"post\"" \
+  " enctype=\"application/x-www-form-urlencoded\"" \
+  " accept-charset=\"UTF-8\">\r\n" \
+  "<p>"
+#define PAGE_INPUT \
+  ": <input type=\"text\" name=\"message\"></p>\r\n" \
+  "<input type=\"submit\" value=\"Send\">\r\n" \
+  "<input type=\"hidden\" name=\"topic\" value=\""
+#define PAGE_HIDDEN_NAME "\"><input type=\"hidden\" name=\"name\" value=\""
+#define PAGE_END "\"></form></body></html>\r\n"
+
+/* The page at / */
+#define FORM_PAGE \
+  "<html><body>\r\n" \
+  "<p>Welcome to TinyChat</p>" \
+  "\r\n<form action=\"conversation\" method=\"post\"" \
+  " enctype=\"application/x-www-form-urlencoded\"" \
+  " accept-charset=\"UTF-8\">\r\n" \
+  "Name: <input type=\"text\" name=\"name\"><br>\r\n" \
+  "Topic: <input type=\"text\" name=\"topic\"><br><br>\r\n" \
+  "<input type=\"submit\" value=\"Join Conversation\">\r\n" \
+  "</form></body></html>\r\n"
+
+/* The start and end of an error page */
+#define ERROR_HEAD "<html><title>Tiny Error</title>" "<body bgcolor=""ffffff"">\r\n"
+#define ERROR_END "<hr><em>The Tiny Web server</em>\r\n"
+
+/* A piece of a response waiting to go out: bytes it borrows, or bytes copied
+   to the connection's out buffer at off if data is NULL. A piece of a
+   cached rendering holds a reference to it until it is sent. */
+typedef struct {
+  const char *data;
+  size_t off, len;
+  struct rendered *ref;
+} segment;
+
+/* A client connection. It is in the epoll set with EPOLLONESHOT, so at most
+   one worker handles it at a time and nothing else touches it meanwhile,
+   except that the main thread may close it for being idle while it is armed.
+   A connection parked in a long poll is out of the epoll set; whichever
+   thread changes its wait_state from WAIT_PARKED queues it for a worker.
+   One parked for a sync is out of it too, until the sync thread queues it. */
+typedef struct conn {
+  int fd;
+  /* request bytes read but not handled yet */
+  char *in;
+  size_t in_len, in_size;
+  /* response not sent yet: segs from segs_done on, with first_sent bytes
+     of the first of them gone already, pending bytes in all */
+  segment *segs;
+  size_t num_segs, segs_size, segs_done, first_sent, pending;
+  /* bytes copied for the segments that don't borrow theirs */
+  char *out;
+  size_t out_len, out_size;
+  int eof;           /* the client has shut down its side */
+  int close_after;   /* close once the pending response is sent */
+  int http11;        /* respond as HTTP/1.1 */
+  int armed;         /* waiting in the epoll set, guarded by conns_lock */
+  time_t last_active;
+  /* a long poll, for messages in waiting_on after wait_since */
+  topic_t *waiting_on;
+  size_t wait_since;
+  time_t wait_deadline;
+  int wait_state;    /* WAIT_*, changed atomically */
+  long wait_started; /* when the long poll came in, in microseconds */
+  /* the sync the responses so far wait for, ticket 0 if none, where the
+     response to the request it is for starts in segs, and the route and
+     start of that request, which is counted once it is done */
+  wal_waiter saving;
+  size_t save_segs;
+  int save_route;
+  long save_started;
+  struct conn *prev_waiter, *next_waiter; /* guarded by waiting_on's lock */
+  struct conn *next; /* in the work queue */
+  struct conn *prev_all, *next_all; /* in the list of every connection */
+} conn_t;
 
 /* Handles HTTP requests/responses transaction */
-void doit(int fd);
+void doit(conn_t *c, char *request, size_t header_len, size_t body_len);
 
-dictionary_t *read_requesthdrs(rio_t *rp);
+dictionary_t *parse_requesthdrs(char *lines);
 
-void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *d);
+void parse_postquery(char *body, size_t len, dictionary_t *headers, dictionary_t *d);
 
 void parse_query(const char *uri, dictionary_t *d);
 
-void serve_form(int fd, const char *pre_content);
+void serve_form(conn_t *c, const char *pre_content);
 
-void clienterror(int fd, char *cause, char *errnum, 
+void clienterror(conn_t *c, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
 
-void serve_conversation(int fd, const char* topic, const char* name, const char *pre_content);
-void conversation_request_form(int fd, const char *pre_content);
-void *go_doit(void *connfdp);
-
+void serve_conversation(conn_t *c, const char* topic, const char* name, topic_t *t);
+void conversation_request_form(conn_t *c, topic_t *t, const char *if_none_match);
+void serve_messages_since(conn_t *c, topic_t *t, size_t since);
+void wait_for_messages(conn_t *c, topic_t *t, size_t since, int seconds);
+
+static void accept_conns(void);
+static void pause_accepting(int err);
+static void resume_accepting(void);
+static void queue_conn(conn_t *c);
+static void *worker(void *arg);
+static void handle_conn(conn_t *c);
+static int read_conn(conn_t *c);
+static void consume_request(conn_t *c, size_t len);
+static void sweep_idle_conns(void);
+static int park_conn(conn_t *c);
+static void finish_wait(conn_t *c);
+static int add_message(topic_t *t, int notice, const char *user, const char *content,
+                       unsigned long *saved);
+static void hold_until_saved(conn_t *c, topic_t *t, unsigned long ticket);
+static void fail_unsaved(conn_t *c);
+static void wake_saved(wal_waiter *list);
+static conn_t *claim_waiters(topic_t *t);
+static void queue_conns(conn_t *list);
+static void unlink_waiter(topic_t *t, conn_t *c);
+static time_t now_seconds(void);
+static long now_us(void);
+static void count_request(int route, long started);
+static void serve_stats(conn_t *c);
+static void add_topic_stats(void *arg, topic_t *t);
+static int write_conn(conn_t *c);
+static long request_length(conn_t *c, size_t *header_len);
+static void conn_send(conn_t *c, const char *buf, size_t len);
+static void conn_send_static(conn_t *c, const char *buf, size_t len);
+static void conn_send_rendered(conn_t *c, struct rendered *r, size_t len);
+static segment *add_segment(conn_t *c);
+static void send_ok_header(conn_t *c, size_t len, const char *content_type, const char *extra);
+static void free_conn(conn_t *c);
+static void arm_conn(conn_t *c, uint32_t events);
+static void close_conn(conn_t *c);
+static void raise_fd_limit(void);
 static void print_stringdictionary(dictionary_t *d);
 
-dictionary_t *topics;
-dictionary_t *topics2;
+/* A topic's messages rendered one way, as far as the snapshot upto. Rendering
+   more only ever writes past len, so whoever holds a reference can keep using
+   the first len bytes they saw; when data fills up, the rendering moves to a
+   larger copy and the old one is freed by its last holder. */
+typedef struct rendered {
+  int refs;
+  topic_snapshot upto;
+  size_t len, size;
+  char data[];
+} rendered_t;
+
+static rendered_t *new_rendered(topic_log *log);
+static rendered_t *get_rendered(topic_t *t, rendered_t **cache,
+                                void (*render_message)(void *arg, const topic_message *m),
+                                size_t *len, topic_snapshot *snap);
+static void release_rendered(rendered_t *r);
+static void render(rendered_t **r, const char *buf, size_t len);
+static void render_html_message(void *arg, const topic_message *m);
+static void render_text_message(void *arg, const topic_message *m);
+
+/* Each topic's conversation, as a topic_log of entity-encoded messages */
+static topic_store *topics;
+
+/* Requests answered on each route, by how long they took; counted atomically */
+static unsigned long route_latency[NUM_ROUTES][LATENCY_BUCKETS];
+static const char *route_names[NUM_ROUTES] = {
+  "GET /", "GET /conversation", "GET /conversation?since=",
+  "GET /conversation?wait=", "GET /say", "POST /conversation",
+  "GET /stats", "errors"
+};
+
+/* Connections open, counted atomically */
+static int num_conns;
+
+/* The epoll set of the listening socket and every connection */
+static int epfd;
+
+/* The listening socket, and whether it is out of the epoll set for want of
+   descriptors. Only the main thread pauses it; whoever frees a descriptor
+   first, or the sweep, resumes it. */
+static int listenfd;
+static int accept_paused;
+/* Whether running out of descriptors has been logged since the last accept */
+static int out_of_fds_logged;
+
+/* Every open connection, for the idle sweep */
+static conn_t *all_conns;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Connections with events, waiting for a worker */
+static conn_t *queue_head, *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
 
 int main(int argc, char **argv) 
 {
   // Set up file descriptors
-  int listenfd, connfd;
-
-  char hostname[MAXLINE], port[MAXLINE];
-
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr;
+  int i, n, opt, level, num_workers;
+  char *data_dir = NULL;
+  time_t last_sweep = now_seconds();
+  struct epoll_event ev, events[MAX_EVENTS];
+  pthread_t th;
 
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((opt = getopt(argc, argv, "d:l:")) != -1) {
+    switch (opt) {
+    case 'd':
+      data_dir = optarg;
+      break;
+    case 'l':
+      if ((level = server_log_parse_level(optarg)) >= 0) {
+        server_log_level = level;
+        break;
+      }
+      /* fall through */
+    default:
+      fprintf(stderr, "usage: %s [-d <data-dir>] [-l error|warn|info|debug] <port> [<worker-threads>]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (argc - optind != 1 && argc - optind != 2) {
+    fprintf(stderr, "usage: %s [-d <data-dir>] [-l error|warn|info|debug] <port> [<worker-threads>]\n", argv[0]);
     exit(1);
   }
+  server_log_start();
+  num_workers = (argc - optind == 2) ? atoi(argv[optind + 1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_workers < 1)
+    num_workers = 1;
 
   // Begin listening on a given socket
-  listenfd = Open_listenfd(argv[1]);
+  listenfd = Open_listenfd(argv[optind]);
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
 
   /* Don't kill the server if there's an error, because
      we want to survive errors due to a client. But we
      do want to report errors. */
   exit_on_error(0);
 
-  topics = make_dictionary(COMPARE_CASE_INSENS, free);
-  topics2 = make_dictionary(COMPARE_CASE_INSENS, free);
+  topics = make_topic_store();
+
+  // Bring back the topics saved before a restart, and keep saving them
+  if (data_dir != NULL && wal_start(data_dir, topics, wake_saved) < 0) {
+    fprintf(stderr, "%s: %s\n", data_dir, strerror(errno));
+    exit(1);
+  }
 
   /* Also, don't stop on broken connections: */
   Signal(SIGPIPE, SIG_IGN);
 
-  // Continually accept clients
-  while (1) {    
+  // Every connection takes a descriptor
+  raise_fd_limit();
+
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    unix_error("epoll_create1 error");
+
+  /* The listening socket is level-triggered, so that connections left
+     waiting once accepting resumes are reported again */
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  for (i = 0; i < num_workers; i++) {
+    Pthread_create(&th, NULL, worker, NULL);
+    Pthread_detach(th);
+  }
+
+  // Hand every connection with something to do to the workers
+  while (1) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+    for (i = 0; i < n; i++) {
+      conn_t *c = events[i].data.ptr;
+      if (c == NULL) {
+        accept_conns();
+        continue;
+      }
+      pthread_mutex_lock(&conns_lock);
+      c->armed = 0;
+      pthread_mutex_unlock(&conns_lock);
+      queue_conn(c);
+    }
+
+    if (now_seconds() != last_sweep) {
+      resume_accepting();
+      sweep_idle_conns();
+      last_sweep = now_seconds();
+    }
+  }
+}
+
+/*
+ * accept_conns - accepts every pending connection and adds it to the epoll set
+ */
+static void accept_conns(void)
+{
+  char hostname[MAXLINE], port[MAXLINE];
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+  int connfd;
+  conn_t *c;
+
+  while (1) {
     clientlen = sizeof(clientaddr);
-    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    if (connfd >= 0) {
-      Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                  port, MAXLINE, 0);
-      // Print this after a browser has connected
-      printf("Accepted connection from (%s, %s)\n", hostname, port);
-      int *connfdp;
-      pthread_t th;
-      connfdp = malloc(sizeof(int));
-      *connfdp = connfd;
-      Pthread_create(&th, NULL, go_doit, connfdp);
-      Pthread_detach(th);
+    connfd = accept4(listenfd, (SA *)&clientaddr, &clientlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connfd < 0) {
+      if (errno == EMFILE || errno == ENFILE)
+        pause_accepting(errno);
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        server_log(LOG_LEVEL_ERROR, "accept error: %s", strerror(errno));
+      return;
     }
+    out_of_fds_logged = 0;
+
+    // Numeric names, since a DNS lookup would stall every connection
+    if (server_log_enabled(LOG_LEVEL_DEBUG)
+        && getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
+                       port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+      server_log(LOG_LEVEL_DEBUG, "Accepted connection from (%s, %s)", hostname, port);
+
+    c = calloc(1, sizeof(conn_t));
+    c->fd = connfd;
+    __atomic_fetch_add(&num_conns, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&conns_lock);
+    c->next_all = all_conns;
+    if (all_conns != NULL)
+      all_conns->prev_all = c;
+    all_conns = c;
+    pthread_mutex_unlock(&conns_lock);
+    arm_conn(c, EPOLLIN);
   }
 }
 
-void *go_doit(void *connfdp){
-  int connfd = *(int *)connfdp;
-  free(connfdp);
-  doit(connfd);
-  Close(connfd);
+/*
+ * pause_accepting - stops watching the listening socket when there is no
+ * descriptor to accept with, since it would otherwise be reported ready
+ * again straight away. Out of the set first, so that a resume in between
+ * can't be undone.
+ */
+static void pause_accepting(int err)
+{
+  struct epoll_event ev;
+
+  ev.events = 0;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, listenfd, &ev) < 0) {
+    server_log(LOG_LEVEL_ERROR, "epoll_ctl error: %s", strerror(errno));
+    return;
+  }
+  __atomic_store_n(&accept_paused, 1, __ATOMIC_RELEASE);
+
+  if (!out_of_fds_logged) {
+    server_log(LOG_LEVEL_ERROR, "accept error: %s; not accepting until a connection closes",
+               strerror(err));
+    out_of_fds_logged = 1;
+  }
+}
+
+/*
+ * resume_accepting - watches the listening socket again if it was paused
+ */
+static void resume_accepting(void)
+{
+  struct epoll_event ev;
+  int paused = 1;
+
+  if (!__atomic_load_n(&accept_paused, __ATOMIC_ACQUIRE)
+      || !__atomic_compare_exchange_n(&accept_paused, &paused, 0, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, listenfd, &ev) < 0)
+    server_log(LOG_LEVEL_ERROR, "epoll_ctl error: %s", strerror(errno));
+}
+
+/*
+ * queue_conn - hands a connection with events to the workers
+ */
+static void queue_conn(conn_t *c)
+{
+  pthread_mutex_lock(&queue_lock);
+  c->next = NULL;
+  if (queue_tail != NULL)
+    queue_tail->next = c;
+  else
+    queue_head = c;
+  queue_tail = c;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+static void *worker(void *arg)
+{
+  conn_t *c;
+
+  while (1) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_head == NULL)
+      pthread_cond_wait(&queue_ready, &queue_lock);
+    c = queue_head;
+    queue_head = c->next;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    handle_conn(c);
+  }
   return NULL;
 }
 
 /*
- * doit - handle one HTTP request/response transaction
+ * handle_conn - moves a connection along as far as it can go without
+ * blocking. Every complete request that has arrived is handled in order,
+ * with the responses sent together; then the connection reads more, and
+ * waits for its next event once there is nothing to read or the socket is
+ * full. A connection that keeps sending goes to the back of the queue
+ * after MAX_REQUESTS_PER_TURN requests. A long poll holds back the requests
+ * after it until it is answered, and a message being saved holds back its
+ * response (and those before it) until it is on disk.
  */
-void doit(int fd) 
+static void handle_conn(conn_t *c)
 {
-  char buf[MAXLINE], *method, *uri, *version;
-  rio_t rio;
-  dictionary_t *headers, *query;
+  size_t header_len;
+  long len;
+  int handled = 0, stopped;
+
+  // Back from a long poll
+  if (c->wait_state != WAIT_NONE)
+    finish_wait(c);
+
+  while (1) {
+    while (!c->close_after && c->waiting_on == NULL && c->saving.ticket == 0
+           && c->pending < FLUSH_SIZE && (len = request_length(c, &header_len)) != 0) {
+      if (len < 0) {
+        c->close_after = 1;
+        break;
+      }
+      doit(c, c->in, header_len, len - header_len);
+      consume_request(c, len);
+      handled++;
+    }
+    stopped = (c->pending >= FLUSH_SIZE || c->saving.ticket != 0);
+
+    // Send nothing until the messages it acknowledges are saved
+    if (c->saving.ticket != 0) {
+      int saved = wal_park(&c->saving);
+
+      if (saved > 0)
+        return;
+      c->saving.ticket = 0;
+      if (saved < 0)
+        fail_unsaved(c);
+      else if (c->waiting_on == NULL)
+        count_request(c->save_route, c->save_started);
+    }
+
+    if (!write_conn(c)) {
+      close_conn(c);
+      return;
+    }
+    if (c->pending > 0) {
+      arm_conn(c, EPOLLOUT);
+      return;
+    }
+    // Wait for a message, with everything before it sent
+    if (c->waiting_on != NULL) {
+      if (park_conn(c))
+        return;
+      continue;
+    }
+    if (c->close_after) {
+      close_conn(c);
+      return;
+    }
+    if (handled >= MAX_REQUESTS_PER_TURN) {
+      queue_conn(c);
+      return;
+    }
+
+    // Stopped to flush or to save, maybe with more requests already here
+    if (stopped)
+      continue;
+
+    if (c->eof) {
+      close_conn(c);
+      return;
+    }
+    switch (read_conn(c)) {
+    case -1:
+      close_conn(c);
+      return;
+    case 0:
+      arm_conn(c, EPOLLIN);
+      return;
+    }
+  }
+}
+
+/*
+ * read_conn - reads what has arrived on a connection until the socket is
+ * drained, returning 1 if anything new (or the end) arrived, 0 if nothing
+ * did, and -1 on an error
+ */
+static int read_conn(conn_t *c)
+{
+  ssize_t n;
+  int got = 0;
+
+  while (!c->eof) {
+    if (c->in_size - c->in_len < READ_SIZE) {
+      c->in_size = c->in_size ? 2 * c->in_size : READ_SIZE;
+      c->in = realloc(c->in, c->in_size + 1);
+    }
+    n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+    if (n > 0) {
+      c->in_len += n;
+      got = 1;
+    }
+    else if (n == 0)
+      c->eof = got = 1;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return got;
+    else if (errno != EINTR)
+      return -1;
+
+    // Don't let one client buffer without bound; what is here gets handled first
+    if (c->in_len > MAX_REQUEST_HEADER + MAX_REQUEST_BODY)
+      return 1;
+  }
+  return got;
+}
+
+/*
+ * consume_request - drops a handled request from the front of the buffer
+ */
+static void consume_request(conn_t *c, size_t len)
+{
+  memmove(c->in, c->in + len, c->in_len - len);
+  c->in_len -= len;
+}
 
-  /* Read request line and headers */
-  Rio_readinitb(&rio, fd);
-  if (Rio_readlineb(&rio, buf, MAXLINE) <= 0)
+/*
+ * write_conn - sends as much of the pending response as the socket takes,
+ * up to MAX_IOVECS segments to a writev, returning 0 on an error
+ */
+static int write_conn(conn_t *c)
+{
+  struct iovec iov[MAX_IOVECS];
+  ssize_t n;
+  size_t i, count, left;
+
+  while (c->segs_done < c->num_segs) {
+    for (i = c->segs_done, count = 0; i < c->num_segs && count < MAX_IOVECS; i++, count++) {
+      segment *seg = &c->segs[i];
+      iov[count].iov_base = (char *)(seg->data ? seg->data : c->out + seg->off);
+      iov[count].iov_len = seg->len;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + c->first_sent;
+    iov[0].iov_len -= c->first_sent;
+
+    n = writev(c->fd, iov, count);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      if (errno != EINTR)
+        return 0;
+      continue;
+    }
+
+    // Let go of the segments that are all sent
+    c->pending -= n;
+    while (n > 0) {
+      segment *seg = &c->segs[c->segs_done];
+      left = seg->len - c->first_sent;
+      if ((size_t)n < left) {
+        c->first_sent += n;
+        break;
+      }
+      n -= left;
+      c->first_sent = 0;
+      c->segs_done++;
+      if (seg->ref != NULL)
+        release_rendered(seg->ref);
+    }
+  }
+  c->num_segs = c->segs_done = c->first_sent = 0;
+  c->out_len = 0;
+  return 1;
+}
+
+/*
+ * request_length - the length of the first request in a connection's buffer
+ * if all of it has arrived, with the length of its request line and headers
+ * in *header_len. Returns 0 if more is to come, or -1 after sending (and
+ * counting, as answered at once) an error for a request that is too large.
+ */
+static long request_length(conn_t *c, size_t *header_len)
+{
+  char *end, *len_str;
+  long body_len = 0;
+
+  if (c->in_len == 0)
+    return 0;
+  c->in[c->in_len] = '\0';
+  if ((end = strstr(c->in, "\r\n\r\n")) == NULL) {
+    if (c->in_len > MAX_REQUEST_HEADER) {
+      clienterror(c, "headers", "431", "Request Header Fields Too Large",
+                  "TinyChat could not read a request that large");
+      count_request(ROUTE_ERROR, now_us());
+      return -1;
+    }
+    return 0;
+  }
+  *header_len = end + 4 - c->in;
+
+  if ((len_str = strcasestr(c->in, "\r\nContent-Length:")) != NULL && len_str < end)
+    body_len = atol(len_str + strlen("\r\nContent-Length:"));
+  if (body_len < 0 || body_len > MAX_REQUEST_BODY) {
+    clienterror(c, "body", "413", "Payload Too Large",
+                "TinyChat could not read a request that large");
+    count_request(ROUTE_ERROR, now_us());
+    return -1;
+  }
+
+  if (c->in_len < *header_len + body_len)
+    return 0;
+  return *header_len + body_len;
+}
+
+/*
+ * conn_send - adds a copy of some bytes to the response waiting to go out on
+ * a connection, in the same segment as the bytes copied just before them
+ */
+static void conn_send(conn_t *c, const char *buf, size_t len)
+{
+  segment *last = c->num_segs > c->segs_done ? &c->segs[c->num_segs - 1] : NULL;
+
+  if (len == 0)
+    return;
+  if (c->out_len + len > c->out_size) {
+    c->out_size = c->out_size ? c->out_size : READ_SIZE;
+    while (c->out_len + len > c->out_size)
+      c->out_size *= 2;
+    c->out = realloc(c->out, c->out_size);
+  }
+
+  if (last == NULL || last->data != NULL || last->off + last->len != c->out_len) {
+    last = add_segment(c);
+    last->data = NULL;
+    last->off = c->out_len;
+    last->len = 0;
+    last->ref = NULL;
+  }
+  memcpy(c->out + c->out_len, buf, len);
+  c->out_len += len;
+  last->len += len;
+  c->pending += len;
+}
+
+/*
+ * conn_send_static - adds bytes that never change or go away, such as a
+ * string constant, to a response without copying them, unless copying is
+ * cheaper
+ */
+static void conn_send_static(conn_t *c, const char *buf, size_t len)
+{
+  segment *seg;
+
+  if (len < BORROW_MIN) {
+    conn_send(c, buf, len);
+    return;
+  }
+  seg = add_segment(c);
+  seg->data = buf;
+  seg->len = len;
+  seg->ref = NULL;
+  c->pending += len;
+}
+
+/*
+ * conn_send_rendered - adds the first len bytes of a rendering to a
+ * response, taking over the caller's reference to it
+ */
+static void conn_send_rendered(conn_t *c, rendered_t *r, size_t len)
+{
+  segment *seg;
+
+  if (len < BORROW_MIN) {
+    conn_send(c, r->data, len);
+    release_rendered(r);
     return;
-  printf("%s", buf);
+  }
+  seg = add_segment(c);
+  seg->data = r->data;
+  seg->len = len;
+  seg->ref = r;
+  c->pending += len;
+}
+
+static segment *add_segment(conn_t *c)
+{
+  if (c->num_segs == c->segs_size) {
+    c->segs_size = c->segs_size ? 2 * c->segs_size : 16;
+    c->segs = realloc(c->segs, c->segs_size * sizeof(segment));
+  }
+  return &c->segs[c->num_segs++];
+}
+
+/*
+ * arm_conn - waits for the next of events on a connection, edge-triggered and
+ * once only, so the connection goes to one worker when it arrives. Arming
+ * under conns_lock keeps the idle sweep from closing it halfway.
+ */
+static void arm_conn(conn_t *c, uint32_t events)
+{
+  struct epoll_event ev;
+  int err = 0;
+
+  ev.events = events | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+  ev.data.ptr = c;
+
+  pthread_mutex_lock(&conns_lock);
+  c->last_active = now_seconds();
+  c->armed = 1;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0
+      && (errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)) {
+    err = errno;
+    c->armed = 0;
+  }
+  pthread_mutex_unlock(&conns_lock);
+
+  if (err) {
+    server_log(LOG_LEVEL_ERROR, "epoll_ctl error: %s", strerror(err));
+    close_conn(c);
+  }
+}
+
+static void close_conn(conn_t *c)
+{
+  pthread_mutex_lock(&conns_lock);
+  if (c->prev_all != NULL)
+    c->prev_all->next_all = c->next_all;
+  else
+    all_conns = c->next_all;
+  if (c->next_all != NULL)
+    c->next_all->prev_all = c->prev_all;
+  pthread_mutex_unlock(&conns_lock);
+
+  free_conn(c);
+}
+
+/*
+ * free_conn - closes a connection that is out of every list and frees it,
+ * with any references its unsent response still holds
+ */
+static void free_conn(conn_t *c)
+{
+  size_t i;
+
+  for (i = c->segs_done; i < c->num_segs; i++) {
+    if (c->segs[i].ref != NULL)
+      release_rendered(c->segs[i].ref);
+  }
+  close(c->fd);
+  __atomic_fetch_sub(&num_conns, 1, __ATOMIC_RELAXED);
+  resume_accepting();
+  free(c->in);
+  free(c->out);
+  free(c->segs);
+  free(c);
+}
+
+/*
+ * sweep_idle_conns - closes the armed connections that have waited too long:
+ * IDLE_TIMEOUT between requests, REQUEST_TIMEOUT partway through one; and
+ * hands long polls past their deadline back to the workers. Only
+ * the main thread takes events, so an armed connection isn't queued, and
+ * no worker can re-arm one while we hold conns_lock.
+ */
+static void sweep_idle_conns(void)
+{
+  time_t now = now_seconds();
+  conn_t *c, *next, *expired = NULL, *timed_out = NULL;
+
+  pthread_mutex_lock(&conns_lock);
+  for (c = all_conns; c != NULL; c = next) {
+    int parked = WAIT_PARKED;
+
+    next = c->next_all;
+    // A long poll that has waited long enough, unless a message just claimed it
+    if (__atomic_load_n(&c->wait_state, __ATOMIC_ACQUIRE) == WAIT_PARKED
+        && now >= c->wait_deadline
+        && __atomic_compare_exchange_n(&c->wait_state, &parked, WAIT_TIMED_OUT, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      c->next = timed_out;
+      timed_out = c;
+      continue;
+    }
+    if (!c->armed)
+      continue;
+    if (now - c->last_active < ((c->in_len == 0 && c->pending == 0) ? IDLE_TIMEOUT : REQUEST_TIMEOUT))
+      continue;
+
+    // Out of the epoll set first, so no event for it is still to come
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->armed = 0;
+    if (c->prev_all != NULL)
+      c->prev_all->next_all = c->next_all;
+    else
+      all_conns = c->next_all;
+    if (c->next_all != NULL)
+      c->next_all->prev_all = c->prev_all;
+    c->next = expired;
+    expired = c;
+  }
+  pthread_mutex_unlock(&conns_lock);
+
+  queue_conns(timed_out);
+
+  for (c = expired; c != NULL; c = next) {
+    next = c->next;
+    free_conn(c);
+  }
+}
+
+/*
+ * park_conn - puts a connection that waits for messages in its topic's
+ * waiters, where nothing else touches it until a message or the sweep
+ * claims it. Returns 0 instead, having answered, if messages came already.
+ */
+static int park_conn(conn_t *c)
+{
+  topic_t *t = c->waiting_on;
+  topic_snapshot snap;
+
+  pthread_mutex_lock(&t->lock);
+  topic_log_snapshot(t->log, &snap);
+  if (snap.last_seq > c->wait_since) {
+    pthread_mutex_unlock(&t->lock);
+    c->waiting_on = NULL;
+    serve_messages_since(c, t, c->wait_since);
+    count_request(ROUTE_WAIT, c->wait_started);
+    return 0;
+  }
+
+  c->prev_waiter = NULL;
+  c->next_waiter = t->waiters;
+  if (t->waiters != NULL)
+    t->waiters->prev_waiter = c;
+  t->waiters = c;
+  __atomic_store_n(&c->wait_state, WAIT_PARKED, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&t->lock);
+  return 1;
+}
+
+/*
+ * finish_wait - answers a long poll that a message or the sweep claimed
+ */
+static void finish_wait(conn_t *c)
+{
+  topic_t *t = c->waiting_on;
+
+  // The sweep leaves it to us to leave the waiters
+  if (__atomic_load_n(&c->wait_state, __ATOMIC_ACQUIRE) == WAIT_TIMED_OUT) {
+    pthread_mutex_lock(&t->lock);
+    unlink_waiter(t, c);
+    pthread_mutex_unlock(&t->lock);
+  }
+  c->wait_state = WAIT_NONE;
+  c->waiting_on = NULL;
+  serve_messages_since(c, t, c->wait_since);
+  count_request(ROUTE_WAIT, c->wait_started);
+}
+
+/*
+ * add_message - adds a message to a topic, whose lock is held, once it is
+ * written to the topic's file if messages are being saved. Sets *saved to a
+ * ticket for hold_until_saved, to be held for (after unlocking) before the
+ * message is acknowledged. Returns 0, or -1 if the message couldn't be
+ * written, in which case nobody sees it.
+ */
+static int add_message(topic_t *t, int notice, const char *user, const char *content,
+                       unsigned long *saved)
+{
+  topic_message m;
+
+  m.time = time(NULL);
+  m.notice = notice;
+  m.user = user;
+  m.user_len = strlen(user);
+  m.content = content;
+  m.content_len = strlen(content);
+  if (wal_append(t, &m, saved) < 0)
+    return -1;
+  topic_log_append(t->log, &m);
+  return 0;
+}
+
+/*
+ * hold_until_saved - keeps the responses on a connection from going out
+ * until the message in t with a ticket is on disk. handle_conn parks the
+ * connection with the sync thread meanwhile rather than tie up a worker.
+ * The response that follows is the one fail_unsaved takes back.
+ */
+static void hold_until_saved(conn_t *c, topic_t *t, unsigned long ticket)
+{
+  if (ticket == 0)
+    return;
+  if (c->saving.ticket == 0)
+    c->save_segs = c->num_segs;
+  if (ticket > c->saving.ticket)
+    c->saving.ticket = ticket;
+  c->saving.topic = t;
+}
+
+/*
+ * fail_unsaved - answers with an error instead of the response held for a
+ * message that didn't make it to disk, dropping any long poll it began
+ */
+static void fail_unsaved(conn_t *c)
+{
+  size_t i;
+
+  for (i = c->save_segs; i < c->num_segs; i++) {
+    c->pending -= c->segs[i].len;
+    if (c->segs[i].ref != NULL)
+      release_rendered(c->segs[i].ref);
+  }
+  c->num_segs = c->save_segs;
+  c->waiting_on = NULL;
+  clienterror(c, c->saving.topic->name, "500", "Internal Server Error",
+              "TinyChat could not save the message");
+  count_request(ROUTE_ERROR, c->save_started);
+}
+
+/*
+ * wake_saved - hands the connections whose messages the sync thread has
+ * just saved back to the workers, to send what they held back
+ */
+static void wake_saved(wal_waiter *list)
+{
+  wal_waiter *w, *next;
+
+  for (w = list; w != NULL; w = next) {
+    next = w->next;
+    queue_conn((conn_t *)((char *)w - offsetof(conn_t, saving)));
+  }
+}
+
+/*
+ * claim_waiters - takes the connections waiting on a topic that has a new
+ * message out of its waiters, returning them in a list for queue_conns.
+ * The topic's lock must be held.
+ */
+static conn_t *claim_waiters(topic_t *t)
+{
+  conn_t *c, *next, *claimed = NULL;
+
+  for (c = t->waiters; c != NULL; c = next) {
+    int parked = WAIT_PARKED;
+
+    next = c->next_waiter;
+    // The sweep may have claimed it first
+    if (__atomic_compare_exchange_n(&c->wait_state, &parked, WAIT_WOKEN, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      unlink_waiter(t, c);
+      c->next = claimed;
+      claimed = c;
+    }
+  }
+  return claimed;
+}
+
+static void queue_conns(conn_t *list)
+{
+  conn_t *c, *next;
+
+  for (c = list; c != NULL; c = next) {
+    next = c->next;
+    queue_conn(c);
+  }
+}
+
+static void unlink_waiter(topic_t *t, conn_t *c)
+{
+  if (c->prev_waiter != NULL)
+    c->prev_waiter->next_waiter = c->next_waiter;
+  else
+    t->waiters = c->next_waiter;
+  if (c->next_waiter != NULL)
+    c->next_waiter->prev_waiter = c->prev_waiter;
+}
+
+static time_t now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static long now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * count_request - counts a request on a route, answered now, that came in
+ * at started
+ */
+static void count_request(int route, long started)
+{
+  long took = now_us() - started;
+  int i = 0;
+
+  while (i < LATENCY_BUCKETS - 1 && took >= (1L << i))
+    i++;
+  __atomic_fetch_add(&route_latency[route][i], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * raise_fd_limit - lets the server have as many descriptors as it may
+ */
+static void raise_fd_limit(void)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/*
+ * doit - handle one HTTP request/response transaction. The request line and
+ * headers are the first header_len bytes of request, and the body follows.
+ */
+void doit(conn_t *c, char *request, size_t header_len, size_t body_len) 
+{
+  char *buf, *method = NULL, *uri = NULL, *version = NULL;
+  dictionary_t *headers, *query;
+  int route = ROUTE_ERROR;
+  long started = now_us();
+
+  /* Split off the request line */
+  buf = request;
+  request = strstr(request, "\r\n") + 2;
+  request[-2] = '\0';
+  server_log(LOG_LEVEL_DEBUG, "%s", buf);
   
+  // A line that doesn't parse may leave method unset, so show all of it
   if (!parse_request_line(buf, &method, &uri, &version)) {
-    clienterror(fd, method, "400", "Bad Request",
+    clienterror(c, buf, "400", "Bad Request",
                 "TinyChat did not recognize the request");
   } else {
     if (strcasecmp(version, "HTTP/1.0")
         && strcasecmp(version, "HTTP/1.1")) {
-      clienterror(fd, version, "501", "Not Implemented",
+      clienterror(c, version, "501", "Not Implemented",
                   "TinyChat does not implement that version");
     } else if (strcasecmp(method, "GET")
                && strcasecmp(method, "POST")) {
-      clienterror(fd, method, "501", "Not Implemented",
+      clienterror(c, method, "501", "Not Implemented",
                   "TinyChat does not implement that method");
     } else {
-      headers = read_requesthdrs(&rio);
+      request[header_len - (request - buf) - 2] = '\0';
+      headers = parse_requesthdrs(request);
+
+      /* HTTP/1.1 keeps the connection unless asked not to, HTTP/1.0 only if asked to */
+      char *connection = dictionary_get(headers, "Connection");
+      c->http11 = !strcasecmp(version, "HTTP/1.1");
+      if (c->http11)
+        c->close_after = (connection != NULL && !strcasecmp(connection, "close"));
+      else
+        c->close_after = (connection == NULL || strcasecmp(connection, "keep-alive"));
 
       /* Parse all query arguments into a dictionary */
       query = make_dictionary(COMPARE_CASE_SENS, free);
       parse_uriquery(uri, query);
       if (!strcasecmp(method, "POST"))
-        read_postquery(&rio, headers, query);
+        parse_postquery(buf + header_len, body_len, headers, query);
 
       /* For debugging, print the dictionary */
-      print_stringdictionary(query);
+      if (server_log_enabled(LOG_LEVEL_DEBUG))
+        print_stringdictionary(query);
 
       // Post requests are handled when the user types in the url into the address bar
       if (strcasecmp(method, "POST")){
 
         if (!strcasecmp(uri, "/")){
           /* The start code sends back a text-field form: */
-          serve_form(fd, "Welcome to TinyChat");
+          route = ROUTE_FORM;
+          serve_form(c, "Welcome to TinyChat");
         }
         else if (starts_with("/conversation", uri))
         {
           char *topic = dictionary_get(query, "topic");
+          char *since = dictionary_get(query, "since");
+          char *wait = dictionary_get(query, "wait");
           char *topic2 = entity_encode(topic);
-          char *conversation = dictionary_get(topics2, topic2);
-          if (conversation != NULL){
-            conversation_request_form(fd, conversation);
+          topic_t *t = topic_store_find(topics, topic2);
+
+          if (since == NULL) {
+            route = ROUTE_CONVERSATION;
+            conversation_request_form(c, t, dictionary_get(headers, "If-None-Match"));
+          }
+          else if (wait != NULL && atoi(wait) > 0) {
+            int failed = 0;
+
+            // A long poll needs a topic to wait on, so one for a new topic
+            // starts it off with its notice, as posting to it would
+            if (t == NULL) {
+              int created;
+              unsigned long saved = 0;
+
+              t = topic_store_lock(topics, topic2, &created);
+              if (created)
+                failed = add_message(t, 1, "", "You created a new topic!", &saved);
+              topic_unlock(t);
+              hold_until_saved(c, t, saved);
+            }
+            if (failed)
+              clienterror(c, topic2, "500", "Internal Server Error",
+                          "TinyChat could not save the message");
+            else {
+              route = ROUTE_WAIT;
+              wait_for_messages(c, t, strtoul(since, NULL, 10), atoi(wait));
+            }
           }
           else {
-            conversation_request_form(fd, strdup(""));
+            route = ROUTE_SINCE;
+            serve_messages_since(c, t, strtoul(since, NULL, 10));
           }
+          free(topic2);
         }
         else if (starts_with("/say", uri)){
           char *user = dictionary_get(query, "user");
           char *topic = dictionary_get(query, "topic");
           char *content = dictionary_get(query, "content");
-          char *appended;
-          char *appended2;
           
           if (user != NULL && topic != NULL){
             char* topic2 = entity_encode(topic);
-            char *conversation = dictionary_get(topics, topic2);
-            char *conversation2 = dictionary_get(topics2, topic2);
-
-            // Check to see if this is a new conversation
-            if (conversation == NULL){
-              conversation = "";
-              conversation2 = "";
-            }
 
             // Encode the user and message
             char* user2 = entity_encode(user);
-            char* content2 = entity_encode(content);            
-
-            // Append the conversations
-            appended = append_strings(conversation, strdup("<p>"), user2, strdup(": "), content2, strdup("</p>"), NULL);
-            appended2 = append_strings(conversation2, user2, strdup(": "), content2, strdup("\r\n"), NULL);
-
-            // Save the conversation after appending the message
-            dictionary_set(topics, topic2, appended);
-            dictionary_set(topics2, topic2, appended2);
+            char* content2 = entity_encode(content != NULL ? content : "");
+
+            // Append the message to the conversation, which is new if need be
+            int created;
+            unsigned long saved;
+            topic_t *t = topic_store_lock(topics, topic2, &created);
+            int failed = add_message(t, 0, user2, content2, &saved);
+            conn_t *woken = failed ? NULL : claim_waiters(t);
+            topic_unlock(t);
+            queue_conns(woken);
+
+            if (failed)
+              clienterror(c, topic2, "500", "Internal Server Error",
+                          "TinyChat could not save the message");
+            else {
+              hold_until_saved(c, t, saved);
+              route = ROUTE_SAY;
+              serve_conversation(c, topic2, user2, t);
+            }
 
-            serve_conversation(fd, topic2, user2, dictionary_get(topics, topic2));
+            free(topic2);
+            free(user2);
+            free(content2);
+          }
+          else {
+            clienterror(c, uri, "400", "Bad Request",
+                        "TinyChat needs a user and a topic to say something");
           }
         }
+        else if (starts_with("/stats", uri)) {
+          route = ROUTE_STATS;
+          serve_stats(c);
+        }
+        else {
+          clienterror(c, uri, "404", "Not Found",
+                      "TinyChat has no such page");
+        }
       }
 
       // Handles GET requests, such as when a button is pressed, or enter.
@@ -191,47 +1266,46 @@ void doit(int fd)
 
         char *message = dictionary_get(query, "message");
         char *name = dictionary_get(query, "name");
-        char *appended;
-        char *appended2;
 
         char* name2 = entity_encode(name);
         char* topic2 = entity_encode(topic);
 
-        char *conversation = dictionary_get(topics, topic2);
-        char *conversation2 = dictionary_get(topics2, topic2);
+        int created, failed = 0;
+        unsigned long saved = 0;
+        topic_t *t = topic_store_lock(topics, topic2, &created);
 
-        // If this conversation doesn't exist yet, create it
-        if (conversation == NULL){
-          conversation = "You created a new topic!";
-          conversation2 = "";
-        }
-
-        printf("Topic: %s\n", topic);
-        printf("Topic2: %s\n", topic2);
-        printf("Conversation: %s\n", conversation2);
+        // If this conversation has nothing in it yet, even if it was made
+        // before and its notice failed to save, start it with a notice
+        // that only the page shows
+        if (topic_log_count(t->log) == 0)
+          failed = add_message(t, 1, "", "You created a new topic!", &saved);
 
-        // If no message was sent, create an empty string for the message
-        if (message == NULL || !strcasecmp(message, strdup(""))){
-          message = "";
-          appended = append_strings(conversation, message, NULL);
-          appended2 = append_strings(conversation2, message, NULL);
-        }
+        server_log(LOG_LEVEL_DEBUG, "Topic: %s", topic);
+        server_log(LOG_LEVEL_DEBUG, "Topic2: %s", topic2);
 
         // If there was a message sent, append it to the coversation.
-        else{
+        if (!failed && message != NULL && message[0] != '\0'){
           char* message2 = entity_encode(message);
-          appended = append_strings(conversation, strdup("<p>"), name2, strdup(": "), message2, strdup("</p>"), NULL);
-          appended2 = append_strings(conversation2, name2, strdup(": "), message2, strdup("\r\n"), NULL);
+          failed = add_message(t, 0, name2, message2, &saved);
+          server_log(LOG_LEVEL_DEBUG, "Message: %s", message2);
+          free(message2);
+        }
+        conn_t *woken = claim_waiters(t);
+        topic_unlock(t);
+        queue_conns(woken);
+
+        // Build and send the new page, or say the post was lost
+        if (failed)
+          clienterror(c, topic2, "500", "Internal Server Error",
+                      "TinyChat could not save the message");
+        else {
+          hold_until_saved(c, t, saved);
+          route = ROUTE_POST;
+          serve_conversation(c, topic2, name2, t);
         }
 
-        printf("Conversation: %s\n", appended2);
-
-        // Save the conversation after appending the message
-        dictionary_set(topics, topic2, appended);
-        dictionary_set(topics2, topic2, appended2);
-
-        // Build and send the new page
-        serve_conversation(fd, topic2, name2, dictionary_get(topics, topic2));
+        free(name2);
+        free(topic2);
       }
 
       /* Clean up */
@@ -244,196 +1318,402 @@ void doit(int fd)
     free(uri);
     free(version);
   }
+
+  // A long poll is counted once it is answered, a post once it is saved
+  if (c->saving.ticket != 0) {
+    c->save_route = route;
+    c->save_started = started;
+  }
+  if (c->waiting_on != NULL)
+    c->wait_started = started;
+  else if (c->saving.ticket == 0)
+    count_request(route, started);
 }
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * parse_requesthdrs - parse HTTP request headers, one per line
  */
-dictionary_t *read_requesthdrs(rio_t *rp) 
+dictionary_t *parse_requesthdrs(char *lines) 
 {
-  char buf[MAXLINE];
+  char *line, *end;
   dictionary_t *d = make_dictionary(COMPARE_CASE_INSENS, free);
 
-  Rio_readlineb(rp, buf, MAXLINE);
-  printf("%s", buf);
-  while(strcmp(buf, "\r\n")) {
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    parse_header_line(buf, d);
+  for (line = lines; *line; line = end) {
+    end = strstr(line, "\r\n");
+    end = end ? end + 2 : line + strlen(line);
+    server_log(LOG_LEVEL_DEBUG, "%.*s", (int)(end - line - (end[-1] == '\n' ? 2 : 0)), line);
+    parse_header_line(line, d);
   }
   
   return d;
 }
 
-void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *dest)
+void parse_postquery(char *body, size_t len, dictionary_t *headers, dictionary_t *dest)
 {
-  char *len_str, *type, *buffer;
-  int len;
+  char *type, *buffer;
   
-  len_str = dictionary_get(headers, "Content-Length");
-  len = (len_str ? atoi(len_str) : 0);
-
   type = dictionary_get(headers, "Content-Type");
   
   buffer = malloc(len+1);
-  Rio_readnb(rp, buffer, len);
+  memcpy(buffer, body, len);
   buffer[len] = 0;
 
-  if (!strcasecmp(type, "application/x-www-form-urlencoded")) {
+  if (type != NULL && !strcasecmp(type, "application/x-www-form-urlencoded")) {
     parse_query(buffer, dest);
   }
 
   free(buffer);
 }
 
-static char *ok_header(size_t len, const char *content_type) {
-  char *len_str, *header;
-  
-  header = append_strings("HTTP/1.0 200 OK\r\n",
-                          "Server: TinyChat Web Server\r\n",
-                          "Connection: close\r\n",
-                          "Content-length: ", len_str = to_string(len), "\r\n",
-                          "Content-type: ", content_type, "\r\n\r\n",
-                          NULL);
-  free(len_str);
-
-  return header;
+/*
+ * send_ok_header - sends the headers of a successful response, in the
+ * request's HTTP version, saying whether the connection stays open, with
+ * the header lines in extra if it isn't NULL
+ */
+static void send_ok_header(conn_t *c, size_t len, const char *content_type, const char *extra)
+{
+  char header[512];
+  int n;
+
+  n = snprintf(header, sizeof(header),
+               "%s"
+               "Server: TinyChat Web Server\r\n"
+               "%s"
+               "Content-length: %zu\r\n"
+               "Content-type: %s\r\n"
+               "%s"
+               "\r\n",
+               c->http11 ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.0 200 OK\r\n",
+               c->close_after ? "Connection: close\r\n" : "Connection: keep-alive\r\n",
+               len, content_type, extra ? extra : "");
+  conn_send(c, header, n);
+  server_log(LOG_LEVEL_DEBUG, "Response headers:\n%.*s", n - 4, header);
 }
 
 /*
  * serve_form - sends a form to a client
  */
-void serve_form(int fd, const char *pre_content)
+void serve_form(conn_t *c, const char *pre_content)
 {
-  size_t len;
-  char *body, *header;
-
-  body = append_strings("<html><body>\r\n",
-                        "<p>Welcome to TinyChat</p>",
-                        "\r\n<form action=\"conversation\" method=\"post\"",
-                        " enctype=\"application/x-www-form-urlencoded\"",
-                        " accept-charset=\"UTF-8\">\r\n",
-                        "Name: <input type=\"text\" name=\"name\"><br>\r\n", 
-                        "Topic: <input type=\"text\" name=\"topic\"><br><br>\r\n",                        
-                        "<input type=\"submit\" value=\"Join Conversation\">\r\n",
-                        "</form></body></html>\r\n",
-                        NULL);
-  
-  len = strlen(body);
+  send_ok_header(c, strlen(FORM_PAGE), "text/html; charset=utf-8", NULL);
+  conn_send_static(c, FORM_PAGE, strlen(FORM_PAGE));
+}
+
+/*
+ * request_form - sends the text of a conversation to a client, which is
+ * empty if the topic doesn't exist. The ETag is the version of the topic,
+ * so a client that has the text already gets a 304 instead.
+ */
+void conversation_request_form(conn_t *c, topic_t *t, const char *if_none_match)
+{
+  rendered_t *r = NULL;
+  topic_snapshot snap = { NULL, NULL, 0, 0, 0 };
+  size_t len = 0;
+  char etag[32], extra[96], header[160];
+
+  if (t != NULL)
+    r = get_rendered(t, &t->text, render_text_message, &len, &snap);
+  snprintf(etag, sizeof(etag), "\"t%zu\"", snap.size);
+  snprintf(extra, sizeof(extra), "ETag: %s\r\nX-Last-Seq: %zu\r\n", etag, snap.last_seq);
+
+  if (if_none_match != NULL
+      && (strstr(if_none_match, etag) != NULL || !strcmp(if_none_match, "*"))) {
+    conn_send(c, header,
+              snprintf(header, sizeof(header),
+                       "%s"
+                       "Server: TinyChat Web Server\r\n"
+                       "%s"
+                       "ETag: %s\r\n\r\n",
+                       c->http11 ? "HTTP/1.1 304 Not Modified\r\n" : "HTTP/1.0 304 Not Modified\r\n",
+                       c->close_after ? "Connection: close\r\n" : "Connection: keep-alive\r\n",
+                       etag));
+    if (r != NULL)
+      release_rendered(r);
+    return;
+  }
 
+  send_ok_header(c, len, "text/plain; charset=utf-8", extra);
+  if (r != NULL)
+    conn_send_rendered(c, r, len);
+}
+
+/*
+ * serve_conversation - sends a form to a client
+ */
+void serve_conversation(conn_t *c, const char *topic, const char *name, topic_t *t)
+{
+  rendered_t *r;
+  topic_snapshot snap;
+  size_t len, topic_len = strlen(topic), name_len = strlen(name);
+
+  r = get_rendered(t, &t->html, render_html_message, &len, &snap);
 
   /* Send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
+  send_ok_header(c, strlen(PAGE_HEAD "<h1>") + topic_len + strlen(PAGE_FORM)
+                 + len + strlen("</p><p>") + name_len + strlen(PAGE_INPUT)
+                 + topic_len + strlen(PAGE_HIDDEN_NAME) + name_len + strlen(PAGE_END),
+                 "text/html; charset=utf-8", NULL);
+
+  /* Send response body to client, the messages around the form */
+  conn_send_static(c, PAGE_HEAD "<h1>", strlen(PAGE_HEAD "<h1>"));
+  conn_send(c, topic, topic_len);
+  conn_send_static(c, PAGE_FORM, strlen(PAGE_FORM));
+  conn_send_rendered(c, r, len);
+  conn_send_static(c, "</p><p>", strlen("</p><p>"));
+  conn_send(c, name, name_len);
+  conn_send_static(c, PAGE_INPUT, strlen(PAGE_INPUT));
+  conn_send(c, topic, topic_len);
+  conn_send_static(c, PAGE_HIDDEN_NAME, strlen(PAGE_HIDDEN_NAME));
+  conn_send(c, name, name_len);
+  conn_send_static(c, PAGE_END, strlen(PAGE_END));
+}
 
-  free(header);
+/*
+ * serve_messages_since - sends the text of the messages in a topic after
+ * since, with X-Last-Seq saying what since to ask with next
+ */
+void serve_messages_since(conn_t *c, topic_t *t, size_t since)
+{
+  rendered_t *r = new_rendered(t ? t->log : NULL);
+  topic_snapshot snap = { NULL, NULL, 0, 0, 0 };
+  char extra[48];
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+  if (t != NULL) {
+    topic_log_snapshot(t->log, &snap);
+    topic_log_each_since(&snap, since, render_text_message, &r);
+  }
+  snprintf(extra, sizeof(extra), "X-Last-Seq: %zu\r\n", snap.last_seq);
 
-  free(body);
+  send_ok_header(c, r->len, "text/plain; charset=utf-8", extra);
+  conn_send_rendered(c, r, r->len);
 }
 
 /*
- * request_form - sends a form to a client
+ * wait_for_messages - answers a request for the messages after since once
+ * there are any, or after seconds (at most MAX_WAIT) with none. The
+ * connection is parked once the responses before this one are sent.
  */
-void conversation_request_form(int fd, const char *pre_content)
+void wait_for_messages(conn_t *c, topic_t *t, size_t since, int seconds)
 {
-  size_t len;
-  char *body, *header;
+  c->waiting_on = t;
+  c->wait_since = since;
+  c->wait_deadline = now_seconds() + (seconds < MAX_WAIT ? seconds : MAX_WAIT);
+}
 
-  body = append_strings(pre_content, NULL);
-  
-  len = strlen(body);
+/*
+ * serve_stats - sends what the server has been doing as plain text: how many
+ * connections are open, how many requests each route has answered and how
+ * fast, and how big each topic is
+ */
+static void serve_stats(conn_t *c)
+{
+  unsigned long counts[LATENCY_BUCKETS], total, seen;
+  char *text = NULL;
+  size_t text_len = 0;
+  FILE *f = open_memstream(&text, &text_len);
+  int route, i, p;
+
+  fprintf(f, "connections %d\n", __atomic_load_n(&num_conns, __ATOMIC_RELAXED));
+  fprintf(f, "log lines dropped %zu\n\n", server_log_dropped());
+
+  fprintf(f, "%-26s %10s %10s %10s %10s\n", "route", "requests", "p50 <us", "p90 <us", "p99 <us");
+  for (route = 0; route < NUM_ROUTES; route++) {
+    total = 0;
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+      total += counts[i] = __atomic_load_n(&route_latency[route][i], __ATOMIC_RELAXED);
+    fprintf(f, "%-26s %10lu", route_names[route], total);
+
+    // The bucket each percentile falls in, as its upper bound
+    for (p = 0; p < 3; p++) {
+      unsigned long rank = total * (p == 0 ? 50 : p == 1 ? 90 : 99) / 100;
+
+      for (i = 0, seen = 0; i < LATENCY_BUCKETS - 1 && (seen += counts[i]) <= rank; i++)
+        ;
+      if (total == 0)
+        fprintf(f, " %10s", "-");
+      else if (i == LATENCY_BUCKETS - 1)
+        fprintf(f, " %10s", "more");
+      else
+        fprintf(f, " %10ld", 1L << i);
+    }
+    fprintf(f, "\n");
+  }
 
+  fprintf(f, "\nrequests answered in under each number of microseconds\n");
+  for (route = 0; route < NUM_ROUTES; route++) {
+    fprintf(f, "%s:", route_names[route]);
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+      unsigned long n = __atomic_load_n(&route_latency[route][i], __ATOMIC_RELAXED);
+      if (n == 0)
+        continue;
+      if (i == LATENCY_BUCKETS - 1)
+        fprintf(f, " more:%lu", n);
+      else
+        fprintf(f, " %ld:%lu", 1L << i, n);
+    }
+    fprintf(f, "\n");
+  }
 
-  /* Send response headers to client */
-  header = ok_header(len, "text/plain; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
+  fprintf(f, "\n%-26s %10s %10s\n", "topic", "messages", "bytes");
+  topic_store_each(topics, add_topic_stats, f);
+  fclose(f);
 
-  free(header);
+  send_ok_header(c, text_len, "text/plain; charset=utf-8", "Cache-Control: no-store\r\n");
+  conn_send(c, text, text_len);
+  free(text);
+}
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+static void add_topic_stats(void *arg, topic_t *t)
+{
+  topic_snapshot snap;
 
-  free(body);
+  topic_log_snapshot(t->log, &snap);
+  fprintf(arg, "%-26s %10zu %10zu\n", t->name, snap.last_seq, snap.size);
 }
 
 /*
- * serve_conversation - sends a form to a client
+ * get_rendered - a topic's messages rendered by render_message, brought up
+ * to date from *cache by rendering just the messages added since. Returns a
+ * reference to release, with the rendering's length in *len and the
+ * snapshot of the topic it is rendered from in *snap.
  */
-void serve_conversation(int fd, const char *topic, const char *name, const char *pre_content)
+static rendered_t *get_rendered(topic_t *t, rendered_t **cache,
+                                void (*render_message)(void *arg, const topic_message *m),
+                                size_t *len, topic_snapshot *snap)
 {
-  size_t len;
-  char *body, *header;
-
-  body = append_strings("<html><style>",
-                        "body { background-color: #ffc805}",
-                        "h1 { color: #111; font-family: 'Open Sans', sans-serif; font-size: 30px; font-weight: 700; line-height: 32px; margin: 0 0 72px; text-align: center; }",
-                        "p { color: #685206; font-family: 'Helvetica Neue', sans-serif; font-size: 14px; font-weight: 700; line-height: 24px; margin: 0 0 24px; text-align: justify; text-justify: inter-word; }",
-                        "</style><body>\r\n",
-                        "<h1>", topic, "</h1>",
-                        "\r\n<form action=\"conversation\" method=\"post\"",
-                        " enctype=\"application/x-www-form-urlencoded\"",
-                        " accept-charset=\"UTF-8\">\r\n",
-                        "<p>", pre_content, "</p><p>",
-                        name, ": <input type=\"text\" name=\"message\"></p>\r\n",                      
-                        "<input type=\"submit\" value=\"Send\">\r\n",
-                        "<input type=\"hidden\" name=\"topic\" value=\"", topic, "\">",
-                        "<input type=\"hidden\" name=\"name\" value=\"", name, "\">",
-                        "</form></body></html>\r\n",
-                        NULL);
-  
-  len = strlen(body);
+  rendered_t *r;
 
+  pthread_mutex_lock(&t->render_lock);
 
-  /* Send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
+  if (*cache == NULL)
+    *cache = new_rendered(t->log);
+
+  topic_log_snapshot(t->log, snap);
+  topic_log_each_after(&(*cache)->upto, snap, render_message, cache);
+  (*cache)->upto = *snap;
+
+  r = *cache;
+  __atomic_add_fetch(&r->refs, 1, __ATOMIC_RELAXED);
+  *len = r->len;
+
+  pthread_mutex_unlock(&t->render_lock);
+  return r;
+}
+
+/*
+ * new_rendered - an empty rendering of log, with one reference
+ */
+static rendered_t *new_rendered(topic_log *log)
+{
+  rendered_t *r = malloc(sizeof(rendered_t) + READ_SIZE);
+
+  r->refs = 1;
+  memset(&r->upto, 0, sizeof(r->upto));
+  r->upto.log = log;
+  r->len = 0;
+  r->size = READ_SIZE;
+  return r;
+}
+
+static void release_rendered(rendered_t *r)
+{
+  if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(r);
+}
 
-  free(header);
+/*
+ * render - adds to the end of a rendering, moving it to a larger copy (in
+ * *r) if it is full
+ */
+static void render(rendered_t **r, const char *buf, size_t len)
+{
+  rendered_t *old = *r;
+
+  if (old->len + len > old->size) {
+    size_t size = old->size * 2;
+    while (old->len + len > size)
+      size *= 2;
+    *r = malloc(sizeof(rendered_t) + size);
+    (*r)->refs = 1;
+    (*r)->upto = old->upto;
+    (*r)->len = old->len;
+    (*r)->size = size;
+    memcpy((*r)->data, old->data, old->len);
+    release_rendered(old);
+  }
+  memcpy((*r)->data + (*r)->len, buf, len);
+  (*r)->len += len;
+}
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+/*
+ * render_html_message - one message as it appears on a conversation page
+ */
+static void render_html_message(void *arg, const topic_message *m)
+{
+  rendered_t **r = arg;
 
-  free(body);
+  if (m->notice) {
+    render(r, m->content, m->content_len);
+    return;
+  }
+  render(r, "<p>", 3);
+  render(r, m->user, m->user_len);
+  render(r, ": ", 2);
+  render(r, m->content, m->content_len);
+  render(r, "</p>", 4);
 }
 
 /*
- * clienterror - returns an error message to the client
+ * render_text_message - one message as it appears in /conversation's text,
+ * which leaves out notices
  */
-void clienterror(int fd, char *cause, char *errnum, 
+static void render_text_message(void *arg, const topic_message *m)
+{
+  rendered_t **r = arg;
+
+  if (m->notice)
+    return;
+  render(r, m->user, m->user_len);
+  render(r, ": ", 2);
+  render(r, m->content, m->content_len);
+  render(r, "\r\n", 2);
+}
+
+/*
+ * clienterror - returns an error message to the client, then closes the
+ * connection, since whatever follows a bad request can't be trusted
+ */
+void clienterror(conn_t *c, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
   size_t len;
-  char *header, *body, *len_str;
+  char header[256];
 
-  body = append_strings("<html><title>Tiny Error</title>",
-                        "<body bgcolor=""ffffff"">\r\n",
-                        errnum, " ", shortmsg,
-                        "<p>", longmsg, ": ", cause,
-                        "<hr><em>The Tiny Web server</em>\r\n",
-                        NULL);
-  len = strlen(body);
+  if (cause == NULL)
+    cause = "";
+  len = strlen(ERROR_HEAD) + strlen(errnum) + 1 + strlen(shortmsg)
+    + strlen("<p>") + strlen(longmsg) + 2 + strlen(cause) + strlen(ERROR_END);
 
-  /* Print the HTTP response */
-  header = append_strings("HTTP/1.0 ", errnum, " ", shortmsg,
-                          "Content-type: text/html; charset=utf-8\r\n",
-                          "Content-length: ", len_str = to_string(len), "\r\n\r\n",
-                          NULL);
-  free(len_str);
-  
-  Rio_writen(fd, header, strlen(header));
-  Rio_writen(fd, body, len);
+  c->close_after = 1;
 
-  free(header);
-  free(body);
+  /* Print the HTTP response */
+  conn_send(c, header,
+            snprintf(header, sizeof(header),
+                     "%s%s %s\r\n"
+                     "Connection: close\r\n"
+                     "Content-type: text/html; charset=utf-8\r\n"
+                     "Content-length: %zu\r\n\r\n",
+                     c->http11 ? "HTTP/1.1 " : "HTTP/1.0 ", errnum, shortmsg, len));
+
+  conn_send(c, ERROR_HEAD, strlen(ERROR_HEAD));
+  conn_send(c, errnum, strlen(errnum));
+  conn_send(c, " ", 1);
+  conn_send(c, shortmsg, strlen(shortmsg));
+  conn_send(c, "<p>", 3);
+  conn_send(c, longmsg, strlen(longmsg));
+  conn_send(c, ": ", 2);
+  conn_send(c, cause, strlen(cause));
+  conn_send(c, ERROR_END, strlen(ERROR_END));
 }
 
 static void print_stringdictionary(dictionary_t *d)
@@ -442,9 +1722,8 @@ static void print_stringdictionary(dictionary_t *d)
 
   count = dictionary_count(d);
   for (i = 0; i < count; i++) {
-    printf("%s=%s\n",
-           dictionary_key(d, i),
-           (const char *)dictionary_value(d, i));
+    server_log(LOG_LEVEL_DEBUG, "%s=%s",
+               dictionary_key(d, i),
+               (const char *)dictionary_value(d, i));
   }
-  printf("\n");
 }
@@ -0,0 +1,215 @@
+/*
+ * topic_log.c - Keeps a topic's messages as records in a list of chunks.
+ *
+ * A topic used to be one string that was copied whole to add a message, so
+ * posting n messages copied O(n^2) bytes. Here a message is copied once, as
+ * a record at the free end of the last chunk; a record that doesn't fit
+ * starts a new chunk, and one larger than CHUNK_SIZE gets a chunk of its
+ * own. Chunks are never moved or resized once allocated.
+ *
+ * Readers don't lock. The adding thread writes a record completely before
+ * publishing it, by storing the chunk's new fill, or for a new chunk the link
+ * to it and then log->last, each with release ordering. A reader that loads
+ * log->last and that chunk's fill with acquire ordering sees every record
+ * before them. The fill packs the chunk's len with its count of records, so
+ * that one load says both how far the chunk goes and the seq it ends at.
+ *
+ * A record is a record_header, the user and the content, each followed by
+ * a '\0', padded to RECORD_ALIGN.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "topic_log.h"
+
+/* bytes of records per chunk, unless one record needs more */
+#define CHUNK_SIZE 16384
+
+/* every record starts at a multiple of this */
+#define RECORD_ALIGN 8
+
+/* Round n up to a multiple of RECORD_ALIGN */
+#define ALIGN(n) (((n) + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1))
+
+/* A chunk's fill: its len in the low FILL_LEN_BITS bits, its records above */
+#define FILL_LEN_BITS 40
+#define FILL(len, records) ((uint64_t)(len) | (uint64_t)(records) << FILL_LEN_BITS)
+#define FILL_LEN(fill) ((size_t)((fill) & (((uint64_t)1 << FILL_LEN_BITS) - 1)))
+#define FILL_RECORDS(fill) ((size_t)((fill) >> FILL_LEN_BITS))
+
+/* The bytes a record takes, given its header */
+#define RECORD_SIZE(h) ALIGN(sizeof(record_header) + (h)->user_len + 1 + (h)->content_len + 1)
+
+typedef struct {
+  uint64_t seq;
+  int64_t time;
+  uint32_t notice;
+  uint32_t user_len;
+  uint32_t content_len;
+} record_header;
+
+typedef struct chunk {
+  struct chunk *next;
+  size_t start;         /* bytes of records in the chunks before this one */
+  size_t first_seq;     /* the seq of the chunk's first record */
+  uint64_t fill;        /* FILL(bytes of records, number of records) */
+  size_t size;
+  char data[];
+} chunk;
+
+struct topic_log {
+  chunk *first, *last;
+  size_t count;
+};
+
+static void visit_records(chunk *ch, size_t off, size_t len,
+                          void (*visit)(void *arg, const topic_message *m),
+                          void *arg);
+
+topic_log *make_topic_log(void) {
+  return calloc(1, sizeof(topic_log));
+}
+
+void free_topic_log(topic_log *log) {
+  chunk *ch, *next;
+
+  for (ch = log->first; ch != NULL; ch = next) {
+    next = ch->next;
+    free(ch);
+  }
+  free(log);
+}
+
+size_t topic_log_count(topic_log *log) {
+  return __atomic_load_n(&log->count, __ATOMIC_RELAXED);
+}
+
+void topic_log_snapshot(topic_log *log, topic_snapshot *snap) {
+  chunk *end = __atomic_load_n(&log->last, __ATOMIC_ACQUIRE);
+  uint64_t fill = end ? __atomic_load_n(&end->fill, __ATOMIC_ACQUIRE) : 0;
+
+  snap->log = log;
+  snap->end = end;
+  snap->end_len = FILL_LEN(fill);
+  snap->size = end ? end->start + snap->end_len : 0;
+  snap->last_seq = end ? end->first_seq + FILL_RECORDS(fill) - 1 : 0;
+}
+
+void topic_log_each_since(const topic_snapshot *snap, size_t since,
+                          void (*visit)(void *arg, const topic_message *m),
+                          void *arg) {
+  chunk *ch;
+  size_t off, len;
+
+  if (snap->end == NULL || since >= snap->last_seq)
+    return;
+
+  // Skip the chunks that end before the messages we want
+  for (ch = snap->log->first; ch != snap->end && ch->next->first_seq <= since + 1; ch = ch->next)
+    ;
+
+  for (; ; ch = ch->next) {
+    len = (ch == snap->end) ? snap->end_len : FILL_LEN(ch->fill);
+    for (off = 0; off < len; off += RECORD_SIZE((record_header *)(ch->data + off))) {
+      if (((record_header *)(ch->data + off))->seq > since)
+        break;
+    }
+    visit_records(ch, off, len, visit, arg);
+    if (ch == snap->end)
+      break;
+  }
+}
+
+void topic_log_each_after(const topic_snapshot *from, const topic_snapshot *to,
+                          void (*visit)(void *arg, const topic_message *m),
+                          void *arg) {
+  chunk *ch;
+  size_t off = 0, len;
+
+  if (to->end == NULL || (from != NULL && from->size == to->size))
+    return;
+
+  if (from != NULL && from->end != NULL) {
+    ch = (chunk *)from->end;
+    off = from->end_len;
+  }
+  else
+    ch = to->log->first;
+
+  for (; ; ch = ch->next, off = 0) {
+    len = (ch == to->end) ? to->end_len : FILL_LEN(ch->fill);
+    visit_records(ch, off, len, visit, arg);
+    if (ch == to->end)
+      break;
+  }
+}
+
+/*
+ * visit_records - calls visit on each record of a chunk from offset off
+ *     up to len
+ */
+static void visit_records(chunk *ch, size_t off, size_t len,
+                          void (*visit)(void *arg, const topic_message *m),
+                          void *arg) {
+  while (off < len) {
+    record_header *h = (record_header *)(ch->data + off);
+    topic_message m;
+
+    m.seq = h->seq;
+    m.time = h->time;
+    m.notice = h->notice;
+    m.user = (const char *)(h + 1);
+    m.user_len = h->user_len;
+    m.content = m.user + h->user_len + 1;
+    m.content_len = h->content_len;
+    visit(arg, &m);
+
+    off += RECORD_SIZE(h);
+  }
+}
+
+void topic_log_append(topic_log *log, const topic_message *m) {
+  size_t user_len = m->user_len, content_len = m->content_len;
+  size_t size = ALIGN(sizeof(record_header) + user_len + 1 + content_len + 1);
+  chunk *ch = log->last, *new_chunk = NULL;
+  size_t len = ch ? FILL_LEN(ch->fill) : 0;
+  record_header *h;
+  char *p;
+
+  if (ch == NULL || ch->size - len < size) {
+    size_t data_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+    ch = new_chunk = malloc(sizeof(chunk) + data_size);
+    ch->next = NULL;
+    ch->start = log->last ? log->last->start + len : 0;
+    ch->first_seq = log->count + 1;
+    ch->fill = FILL(0, 0);
+    ch->size = data_size;
+    len = 0;
+  }
+
+  h = (record_header *)(ch->data + len);
+  h->seq = log->count + 1;
+  h->time = m->time;
+  h->notice = m->notice;
+  h->user_len = user_len;
+  h->content_len = content_len;
+  p = (char *)(h + 1);
+  memcpy(p, m->user, user_len);
+  p[user_len] = '\0';
+  memcpy(p + user_len + 1, m->content, content_len);
+  p[user_len + 1 + content_len] = '\0';
+
+  // Publish the record
+  if (new_chunk == NULL)
+    __atomic_store_n(&ch->fill, FILL(len + size, FILL_RECORDS(ch->fill) + 1), __ATOMIC_RELEASE);
+  else {
+    ch->fill = FILL(size, 1);
+    if (log->last != NULL)
+      __atomic_store_n(&log->last->next, ch, __ATOMIC_RELEASE);
+    else
+      __atomic_store_n(&log->first, ch, __ATOMIC_RELEASE);
+    __atomic_store_n(&log->last, ch, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&log->count, log->count + 1, __ATOMIC_RELAXED);
+}
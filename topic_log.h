@@ -0,0 +1,83 @@
+/*
+ * topic_log.h - Append-only logs of the messages in a tinychat topic
+ */
+#ifndef TOPIC_LOG_H
+#define TOPIC_LOG_H
+
+#include <stddef.h>
+#include <time.h>
+
+typedef struct topic_log topic_log;
+
+/* One message, as it is kept in a log */
+typedef struct {
+  size_t seq;           /* the message's number in its topic, from 1 */
+  time_t time;
+  int notice;           /* from the server rather than a user */
+  const char *user;     /* "" for a notice */
+  size_t user_len;
+  const char *content;
+  size_t content_len;
+} topic_message;
+
+/* The messages of a log up to some moment, however many are added after */
+typedef struct {
+  topic_log *log;
+  const void *end;      /* the last chunk then, or NULL if there was none */
+  size_t end_len;
+  size_t size;          /* bytes of records then, which only ever grows */
+  size_t last_seq;      /* the seq of the last message then, or 0 */
+} topic_snapshot;
+
+topic_log *make_topic_log(void);
+
+/*
+ * free_topic_log - frees a log and all of its chunks
+ */
+void free_topic_log(topic_log *log);
+
+/*
+ * topic_log_append - adds a message to the end of a log, numbered with the
+ *     next seq whatever m->seq is. Its strings are copied once, to the end
+ *     of the last chunk (or a new one), so adding costs the size of the
+ *     message however long the log is. The log doesn't encode them; callers
+ *     store them ready to show.
+ *
+ *     Only one thread may add to a log at a time, but any number may read it
+ *     meanwhile without locking: a message is published only once it is
+ *     completely written.
+ */
+void topic_log_append(topic_log *log, const topic_message *m);
+
+size_t topic_log_count(topic_log *log);
+
+/*
+ * topic_log_snapshot - takes a snapshot of the messages published so far,
+ *     so that several passes over a log see the same messages
+ */
+void topic_log_snapshot(topic_log *log, topic_snapshot *snap);
+
+/*
+ * topic_log_each - calls visit on each message of a snapshot, oldest first
+ */
+void topic_log_each(const topic_snapshot *snap,
+                    void (*visit)(void *arg, const topic_message *m),
+                    void *arg);
+
+/*
+ * topic_log_each_since - calls visit on each message of a snapshot whose seq
+ *     is greater than since, skipping the chunks before them
+ */
+void topic_log_each_since(const topic_snapshot *snap, size_t since,
+                          void (*visit)(void *arg, const topic_message *m),
+                          void *arg);
+
+/*
+ * topic_log_each_after - calls visit on each message of snapshot to that
+ *     isn't in the earlier snapshot from, oldest first
+ */
+void topic_log_each_after(const topic_snapshot *from, const topic_snapshot *to,
+                          void (*visit)(void *arg, const topic_message *m),
+                          void *arg);
+
+#endif
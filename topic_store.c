@@ -0,0 +1,170 @@
+/*
+ * topic_store.c - A hash table of topics split into shards.
+ *
+ * Each shard is a chained hash table with its own reader-writer lock, held
+ * for reading to look a topic up and for writing only to add one, so looking
+ * up topics in different shards never contends, and in the same shard only
+ * with a topic being created. Adding a message takes just the topic's own
+ * mutex, and reading its messages takes no lock at all (see topic_log.c).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "topic_store.h"
+
+/* The low SHARD_BITS bits of a name's hash pick its shard */
+#define SHARD_BITS 6
+#define NUM_SHARDS (1 << SHARD_BITS)
+
+/* buckets a shard starts with, doubled whenever it has more topics than that */
+#define INITIAL_BUCKETS 16
+
+typedef struct {
+  pthread_rwlock_t lock;
+  topic_t **buckets;
+  size_t num_buckets;     /* a power of two */
+  size_t count;
+} shard;
+
+struct topic_store {
+  shard shards[NUM_SHARDS];
+};
+
+static uint64_t hash_name(const char *name);
+static topic_t *find_in_shard(shard *sh, const char *name, uint64_t hash);
+static void grow_shard(shard *sh);
+
+topic_store *make_topic_store(void) {
+  topic_store *store = malloc(sizeof(topic_store));
+  int i;
+
+  for (i = 0; i < NUM_SHARDS; i++) {
+    pthread_rwlock_init(&store->shards[i].lock, NULL);
+    store->shards[i].num_buckets = INITIAL_BUCKETS;
+    store->shards[i].buckets = calloc(INITIAL_BUCKETS, sizeof(topic_t *));
+    store->shards[i].count = 0;
+  }
+  return store;
+}
+
+topic_t *topic_store_find(topic_store *store, const char *name) {
+  uint64_t hash = hash_name(name);
+  shard *sh = &store->shards[hash & (NUM_SHARDS - 1)];
+  topic_t *t;
+
+  pthread_rwlock_rdlock(&sh->lock);
+  t = find_in_shard(sh, name, hash);
+  pthread_rwlock_unlock(&sh->lock);
+  return t;
+}
+
+topic_t *topic_store_lock(topic_store *store, const char *name, int *created) {
+  uint64_t hash = hash_name(name);
+  shard *sh = &store->shards[hash & (NUM_SHARDS - 1)];
+  topic_t *t;
+
+  *created = 0;
+  if ((t = topic_store_find(store, name)) != NULL) {
+    pthread_mutex_lock(&t->lock);
+    return t;
+  }
+
+  pthread_rwlock_wrlock(&sh->lock);
+  // Someone may have created it since we looked
+  if ((t = find_in_shard(sh, name, hash)) == NULL) {
+    size_t b;
+
+    t = malloc(sizeof(topic_t));
+    t->name = strdup(name);
+    t->log = make_topic_log();
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_mutex_init(&t->render_lock, NULL);
+    t->html = t->text = NULL;
+    t->waiters = NULL;
+    t->wal_fd = -1;
+    t->wal_size = 0;
+    t->wal_dirty = 0;
+    t->wal_failed = 0;
+
+    if (sh->count == sh->num_buckets)
+      grow_shard(sh);
+    b = (hash >> SHARD_BITS) & (sh->num_buckets - 1);
+    t->next = sh->buckets[b];
+    sh->buckets[b] = t;
+    sh->count++;
+    *created = 1;
+  }
+  // Locked before anyone else can find it, if it is new
+  pthread_mutex_lock(&t->lock);
+  pthread_rwlock_unlock(&sh->lock);
+  return t;
+}
+
+void topic_unlock(topic_t *t) {
+  pthread_mutex_unlock(&t->lock);
+}
+
+void topic_store_each(topic_store *store, void (*visit)(void *arg, topic_t *t), void *arg) {
+  size_t b;
+  topic_t *t;
+  int i;
+
+  for (i = 0; i < NUM_SHARDS; i++) {
+    shard *sh = &store->shards[i];
+
+    pthread_rwlock_rdlock(&sh->lock);
+    for (b = 0; b < sh->num_buckets; b++) {
+      for (t = sh->buckets[b]; t != NULL; t = t->next)
+        visit(arg, t);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+  }
+}
+
+/*
+ * hash_name - FNV-1a of a name in lowercase, so that names that only
+ *     differ in case are in the same shard and bucket
+ */
+static uint64_t hash_name(const char *name) {
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; *name; name++) {
+    h ^= (unsigned char)tolower((unsigned char)*name);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static topic_t *find_in_shard(shard *sh, const char *name, uint64_t hash) {
+  topic_t *t;
+
+  for (t = sh->buckets[(hash >> SHARD_BITS) & (sh->num_buckets - 1)]; t != NULL; t = t->next) {
+    if (!strcasecmp(t->name, name))
+      return t;
+  }
+  return NULL;
+}
+
+/*
+ * grow_shard - doubles a shard's buckets; its write lock must be held
+ */
+static void grow_shard(shard *sh) {
+  size_t num_buckets = sh->num_buckets * 2, i, b;
+  topic_t **buckets = calloc(num_buckets, sizeof(topic_t *));
+  topic_t *t, *next;
+
+  for (i = 0; i < sh->num_buckets; i++) {
+    for (t = sh->buckets[i]; t != NULL; t = next) {
+      next = t->next;
+      b = (hash_name(t->name) >> SHARD_BITS) & (num_buckets - 1);
+      t->next = buckets[b];
+      buckets[b] = t;
+    }
+  }
+  free(sh->buckets);
+  sh->buckets = buckets;
+  sh->num_buckets = num_buckets;
+}
@@ -0,0 +1,59 @@
+/*
+ * topic_store.h - The topics of a tinychat server, shared between threads
+ */
+#ifndef TOPIC_STORE_H
+#define TOPIC_STORE_H
+
+#include <pthread.h>
+
+#include "topic_log.h"
+
+/* A topic. Topics are never removed, so a pointer to one stays good. */
+typedef struct topic {
+  char *name;
+  topic_log *log;
+  pthread_mutex_t lock;   /* held to add to log */
+  /* the server's renderings of log, brought up to date when they are used */
+  pthread_mutex_t render_lock;
+  struct rendered *html, *text;
+  /* connections long-polling for its next message, guarded by lock */
+  struct conn *waiters;
+  /* its file (see topic_wal.c), -1 until it has one; guarded by lock */
+  int wal_fd;
+  size_t wal_size;
+  /* whether it is waiting for a sync, and the next one that is */
+  int wal_dirty;
+  /* the first sync pass its file failed in, after which nothing more is
+     saved to it, or 0; set under both lock and topic_wal.c's lock */
+  unsigned long wal_failed;
+  struct topic *next_dirty;
+  struct topic *next;     /* in its shard's bucket */
+} topic_t;
+
+typedef struct topic_store topic_store;
+
+topic_store *make_topic_store(void);
+
+/*
+ * topic_store_find - the topic with a name (compared ignoring case), or NULL.
+ *     This only takes a read lock on the name's shard, so finds never wait on
+ *     each other, only briefly on a topic being created in the same shard.
+ */
+topic_t *topic_store_find(topic_store *store, const char *name);
+
+/*
+ * topic_store_lock - the topic with a name, created if there is none yet,
+ *     with its lock held. *created says whether it was created, so that the
+ *     caller can start it off before anyone else can add to it.
+ */
+topic_t *topic_store_lock(topic_store *store, const char *name, int *created);
+
+void topic_unlock(topic_t *t);
+
+/*
+ * topic_store_each - calls visit with every topic, holding each shard's read
+ *     lock in turn, so visit mustn't create topics
+ */
+void topic_store_each(topic_store *store, void (*visit)(void *arg, topic_t *t), void *arg);
+
+#endif
@@ -0,0 +1,415 @@
+/*
+ * topic_wal.c - Each topic's messages, appended to a file of its own.
+ *
+ * A file starts with a header naming its topic, then has one record per
+ * message in the order of their seqs:
+ *
+ *     header:  "TCHATLG1", name length (4 bytes), name
+ *     record:  payload length (4), FNV-1a of the payload (4), then a payload
+ *              of time (8), notice (4), user length (4), content length (4),
+ *              user, content
+ *
+ * Integers are in host byte order. Nothing is padded, so records are read
+ * with memcpy. A file is only ever appended to, except that recovery cuts
+ * off a record that doesn't check out along with everything after it.
+ *
+ * Appending only writes; one sync thread does the syncing. Each pass it takes
+ * every topic written to since the last pass and fdatasyncs their files, then
+ * hands back everyone parked waiting on that pass, so concurrent posters share
+ * the cost of a sync instead of each paying for their own, and none of them
+ * holds a thread while they wait. A file that fails to sync may have lost
+ * some of what was written to it, so its topic saves nothing more, and those
+ * waiting on it from that pass on are told their messages failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "topic_wal.h"
+#include "server_log.h"
+
+#define WAL_MAGIC "TCHATLG1"
+#define MAGIC_LEN 8
+
+/* Bytes before a record's payload, and of a payload before its strings */
+#define RECORD_HEAD 8
+#define PAYLOAD_HEAD 20
+
+/* What 32-bit FNV-1a starts from */
+#define FNV_BASIS 2166136261u
+
+/* The directory holding the logs, or NULL if nothing is saved */
+static char *wal_dir;
+static int dir_fd = -1;
+
+/* Number of the next file to create */
+static unsigned next_file;
+
+/* Topics written to since the sync thread last took them */
+static topic_t *dirty;
+/* Whether a file has been created since, so the directory needs a sync too */
+static int dir_dirty;
+/* Tickets: the pass now being written to, and the last one synced */
+static unsigned long filling = 1, synced;
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_written = PTHREAD_COND_INITIALIZER;
+/* Waiting for a sync, and what to hand them to once theirs is done */
+static wal_waiter *parked;
+static void (*wake_synced)(wal_waiter *list);
+
+static int recover_file(topic_store *store, const char *file);
+static int create_file(topic_t *t);
+static void *sync_thread(void *arg);
+static uint32_t checksum(uint32_t h, const char *p, size_t len);
+
+int wal_start(const char *dir, topic_store *store, void (*wake)(wal_waiter *list)) {
+  DIR *d;
+  struct dirent *e;
+  pthread_t th;
+  int topics = 0;
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return -1;
+  if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return -1;
+  if ((d = fdopendir(dup(dir_fd))) == NULL)
+    return -1;
+  wal_dir = strdup(dir);
+  wake_synced = wake;
+
+  while ((e = readdir(d)) != NULL) {
+    unsigned n;
+    char end;
+
+    if (sscanf(e->d_name, "topic-%u.lo%c", &n, &end) != 2 || end != 'g')
+      continue;
+    if (n >= next_file)
+      next_file = n + 1;
+    topics += recover_file(store, e->d_name);
+  }
+  closedir(d);
+  server_log(LOG_LEVEL_INFO, "Recovered %d topics from %s", topics, dir);
+
+  pthread_create(&th, NULL, sync_thread, NULL);
+  pthread_detach(th);
+  return 0;
+}
+
+/*
+ * recover_file - adds the topic logged in a file to store, returning 1, or
+ *     0 if the file isn't a good log
+ */
+static int recover_file(topic_store *store, const char *file) {
+  char path[4096];
+  struct stat st;
+  const char *p;
+  size_t off, name_len, file_size;
+  uint32_t len32;
+  char *name;
+  topic_t *t;
+  int fd, created;
+
+  snprintf(path, sizeof(path), "%s/%s", wal_dir, file);
+  if ((fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+    server_log(LOG_LEVEL_ERROR, "%s: %s", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return 0;
+  }
+
+  // A crash while the file was being created can leave too little to name it
+  if (st.st_size < MAGIC_LEN + 4
+      || (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    server_log(LOG_LEVEL_WARN, "%s: not a topic log, skipping it", path);
+    close(fd);
+    return 0;
+  }
+  file_size = st.st_size;
+  madvise((void *)p, file_size, MADV_SEQUENTIAL);
+
+  memcpy(&len32, p + MAGIC_LEN, 4);
+  name_len = len32;
+  if (memcmp(p, WAL_MAGIC, MAGIC_LEN) || name_len == 0
+      || name_len > file_size - MAGIC_LEN - 4) {
+    server_log(LOG_LEVEL_WARN, "%s: not a topic log, skipping it", path);
+    munmap((void *)p, file_size);
+    close(fd);
+    return 0;
+  }
+  name = strndup(p + MAGIC_LEN + 4, name_len);
+
+  t = topic_store_lock(store, name, &created);
+  if (!created) {
+    server_log(LOG_LEVEL_WARN, "%s: topic %s is logged twice, skipping this log", path, name);
+    topic_unlock(t);
+    munmap((void *)p, file_size);
+    close(fd);
+    free(name);
+    return 0;
+  }
+
+  off = MAGIC_LEN + 4 + name_len;
+  while (file_size - off >= RECORD_HEAD + PAYLOAD_HEAD) {
+    const char *payload = p + off + RECORD_HEAD;
+    uint32_t size, sum, notice, user_len, content_len;
+    int64_t stamp;
+    topic_message m;
+
+    memcpy(&size, p + off, 4);
+    memcpy(&sum, p + off + 4, 4);
+    if (size < PAYLOAD_HEAD || size > file_size - off - RECORD_HEAD
+        || checksum(FNV_BASIS, payload, size) != sum)
+      break;
+    memcpy(&stamp, payload, 8);
+    memcpy(&notice, payload + 8, 4);
+    memcpy(&user_len, payload + 12, 4);
+    memcpy(&content_len, payload + 16, 4);
+    if ((size_t)PAYLOAD_HEAD + user_len + content_len != size)
+      break;
+
+    m.time = stamp;
+    m.notice = notice;
+    m.user = payload + PAYLOAD_HEAD;
+    m.user_len = user_len;
+    m.content = payload + PAYLOAD_HEAD + user_len;
+    m.content_len = content_len;
+    topic_log_append(t->log, &m);
+    off += RECORD_HEAD + size;
+  }
+
+  if (off < file_size) {
+    server_log(LOG_LEVEL_WARN, "%s: cutting off %zu bytes after its last good message",
+               path, file_size - off);
+    if (ftruncate(fd, off) < 0 || fdatasync(fd) < 0)
+      server_log(LOG_LEVEL_ERROR, "%s: %s", path, strerror(errno));
+  }
+  munmap((void *)p, file_size);
+
+  t->wal_fd = fd;
+  t->wal_size = off;
+  topic_unlock(t);
+  free(name);
+  return 1;
+}
+
+int wal_append(topic_t *t, const topic_message *m, unsigned long *ticket) {
+  char head[RECORD_HEAD + PAYLOAD_HEAD];
+  struct iovec iov[3];
+  uint32_t size = PAYLOAD_HEAD + m->user_len + m->content_len, sum, u32;
+  int64_t stamp = m->time;
+  ssize_t n;
+
+  *ticket = 0;
+  if (wal_dir == NULL)
+    return 0;
+  // Past a failed sync, what follows would be numbered wrong after a restart
+  if (t->wal_failed != 0 || (t->wal_fd < 0 && create_file(t) < 0))
+    return -1;
+
+  memcpy(head + RECORD_HEAD, &stamp, 8);
+  u32 = m->notice;
+  memcpy(head + RECORD_HEAD + 8, &u32, 4);
+  u32 = m->user_len;
+  memcpy(head + RECORD_HEAD + 12, &u32, 4);
+  u32 = m->content_len;
+  memcpy(head + RECORD_HEAD + 16, &u32, 4);
+
+  sum = checksum(FNV_BASIS, head + RECORD_HEAD, PAYLOAD_HEAD);
+  sum = checksum(sum, m->user, m->user_len);
+  sum = checksum(sum, m->content, m->content_len);
+  memcpy(head, &size, 4);
+  memcpy(head + 4, &sum, 4);
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = sizeof(head);
+  iov[1].iov_base = (void *)m->user;
+  iov[1].iov_len = m->user_len;
+  iov[2].iov_base = (void *)m->content;
+  iov[2].iov_len = m->content_len;
+  n = writev(t->wal_fd, iov, 3);
+  if (n != (ssize_t)(RECORD_HEAD + size)) {
+    // Don't leave part of a record for the next one to be written after
+    server_log(LOG_LEVEL_ERROR, "%s: can't save a message: %s", t->name,
+               n < 0 ? strerror(errno) : "short write");
+    if (n > 0 && ftruncate(t->wal_fd, t->wal_size) < 0) {
+      server_log(LOG_LEVEL_ERROR, "%s: %s; saving nothing more to it", t->name, strerror(errno));
+      pthread_mutex_lock(&wal_lock);
+      t->wal_failed = filling;
+      pthread_mutex_unlock(&wal_lock);
+    }
+    return -1;
+  }
+  t->wal_size += n;
+
+  pthread_mutex_lock(&wal_lock);
+  if (!t->wal_dirty) {
+    t->wal_dirty = 1;
+    t->next_dirty = dirty;
+    dirty = t;
+  }
+  *ticket = filling;
+  pthread_cond_signal(&wal_written);
+  pthread_mutex_unlock(&wal_lock);
+  return 0;
+}
+
+int wal_park(wal_waiter *w) {
+  unsigned long failed;
+  int result = 0;
+
+  pthread_mutex_lock(&wal_lock);
+  failed = w->topic->wal_failed;
+  if (failed != 0 && w->ticket >= failed)
+    result = -1;
+  else if (synced < w->ticket) {
+    w->next = parked;
+    parked = w;
+    result = 1;
+  }
+  pthread_mutex_unlock(&wal_lock);
+  return result;
+}
+
+/*
+ * create_file - starts a file for a topic that has none yet; its lock is held
+ */
+static int create_file(topic_t *t) {
+  char path[4096], head[MAGIC_LEN + 4];
+  uint32_t name_len = strlen(t->name);
+  struct iovec iov[2];
+  unsigned n;
+  int fd;
+
+  do {
+    pthread_mutex_lock(&wal_lock);
+    n = next_file++;
+    pthread_mutex_unlock(&wal_lock);
+    snprintf(path, sizeof(path), "%s/topic-%08u.log", wal_dir, n);
+  } while ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644)) < 0
+           && errno == EEXIST);
+  if (fd < 0) {
+    server_log(LOG_LEVEL_ERROR, "%s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  memcpy(head, WAL_MAGIC, MAGIC_LEN);
+  memcpy(head + MAGIC_LEN, &name_len, 4);
+  iov[0].iov_base = head;
+  iov[0].iov_len = sizeof(head);
+  iov[1].iov_base = t->name;
+  iov[1].iov_len = name_len;
+  if (writev(fd, iov, 2) != (ssize_t)(sizeof(head) + name_len)) {
+    server_log(LOG_LEVEL_ERROR, "%s: can't write its header", path);
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  t->wal_fd = fd;
+  t->wal_size = sizeof(head) + name_len;
+  pthread_mutex_lock(&wal_lock);
+  dir_dirty = 1;
+  pthread_mutex_unlock(&wal_lock);
+  return 0;
+}
+
+/*
+ * sync_thread - syncs what has been written, a pass at a time, forever
+ */
+static void *sync_thread(void *arg) {
+  topic_t **synced_topics = NULL;
+  size_t num_topics, num_failed, i, topics_size = 0;
+  unsigned long pass;
+  int sync_dir, dir_failed;
+  topic_t *t;
+  wal_waiter *w, **link, *woken;
+
+  for (;;) {
+    pthread_mutex_lock(&wal_lock);
+    while (dirty == NULL)
+      pthread_cond_wait(&wal_written, &wal_lock);
+
+    // Anything written from here on waits for the next pass
+    pass = filling++;
+    sync_dir = dir_dirty;
+    dir_dirty = 0;
+    num_topics = 0;
+    for (t = dirty; t != NULL; t = t->next_dirty) {
+      if (num_topics == topics_size) {
+        topics_size = topics_size ? topics_size * 2 : 64;
+        synced_topics = realloc(synced_topics, topics_size * sizeof(topic_t *));
+      }
+      synced_topics[num_topics++] = t;
+      t->wal_dirty = 0;
+    }
+    dirty = NULL;
+    pthread_mutex_unlock(&wal_lock);
+
+    // New files' names have to be on disk as well as what is in them, and
+    // without knowing which are new, every file in the pass fails with them
+    dir_failed = sync_dir && fsync(dir_fd) < 0;
+    if (dir_failed)
+      server_log(LOG_LEVEL_ERROR, "%s: %s", wal_dir, strerror(errno));
+    num_failed = 0;
+    for (i = 0; i < num_topics; i++) {
+      t = synced_topics[i];
+      if (fdatasync(t->wal_fd) < 0) {
+        server_log(LOG_LEVEL_ERROR, "%s: %s; saving nothing more to it", t->name, strerror(errno));
+        synced_topics[num_failed++] = t;
+      }
+      else if (dir_failed)
+        synced_topics[num_failed++] = t;
+    }
+
+    // Failed before the pass counts as synced, so its waiters see it
+    for (i = 0; i < num_failed; i++) {
+      t = synced_topics[i];
+      pthread_mutex_lock(&t->lock);
+      pthread_mutex_lock(&wal_lock);
+      if (t->wal_failed == 0)
+        t->wal_failed = pass;
+      pthread_mutex_unlock(&wal_lock);
+      pthread_mutex_unlock(&t->lock);
+    }
+
+    // Those waiting for the next pass stay parked
+    pthread_mutex_lock(&wal_lock);
+    synced = pass;
+    woken = NULL;
+    for (link = &parked; (w = *link) != NULL; ) {
+      if (w->ticket <= synced) {
+        *link = w->next;
+        w->next = woken;
+        woken = w;
+      }
+      else
+        link = &w->next;
+    }
+    pthread_mutex_unlock(&wal_lock);
+    if (woken != NULL)
+      wake_synced(woken);
+  }
+  return NULL;
+}
+
+/*
+ * checksum - 32-bit FNV-1a of len more bytes, after those that hashed to h
+ *     (FNV_BASIS to start)
+ */
+static uint32_t checksum(uint32_t h, const char *p, size_t len) {
+  while (len-- > 0) {
+    h ^= (unsigned char)*p++;
+    h *= 16777619u;
+  }
+  return h;
+}
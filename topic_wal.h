@@ -0,0 +1,56 @@
+/*
+ * topic_wal.h - Keeps tinychat's topics on disk, one append-only log a topic
+ */
+#ifndef TOPIC_WAL_H
+#define TOPIC_WAL_H
+
+#include "topic_store.h"
+
+/* Something waiting for the sync with a ticket, such as a response that
+   mustn't go out before the message it acknowledges is on disk. It is kept
+   in whatever waits and linked into the sync thread's list meanwhile. */
+typedef struct wal_waiter {
+  unsigned long ticket;
+  topic_t *topic;    /* whose message the ticket is for */
+  struct wal_waiter *next;
+} wal_waiter;
+
+/*
+ * wal_start - loads every topic logged in dir into store and starts saving
+ *     new messages there, making dir if need be. Returns 0, or -1 (with
+ *     errno set) if dir can't be used. Until it is called, nothing is saved.
+ *     wake is called from the sync thread with a list of the waiters parked
+ *     by wal_park whose tickets have just been synced.
+ *
+ *     A log is read by mapping it and walking its records, so recovery costs
+ *     about as much as reading the files once. A record torn by a crash, and
+ *     whatever follows it, is cut off the end of its log.
+ */
+int wal_start(const char *dir, topic_store *store, void (*wake)(wal_waiter *list));
+
+/*
+ * wal_append - writes a message to t's file, before it is added to t's log.
+ *     t's lock must be held, so that messages are written in the order they
+ *     are numbered. The write is not synced yet; *ticket is set to a ticket
+ *     to pass to wal_park, or 0 if messages aren't being saved. Returns 0, or
+ *     -1 if the message couldn't be written, in which case it mustn't be
+ *     added to the log either.
+ */
+int wal_append(topic_t *t, const topic_message *m, unsigned long *ticket);
+
+/*
+ * wal_park - waits for w->ticket without blocking. Returns 0 if it is synced
+ *     already, or -1 if syncing w->topic's file failed, which loses the
+ *     message for good. Otherwise returns 1, having added w to the waiters
+ *     handed to wake after the sync it needs, and which w mustn't be touched
+ *     before; calling wal_park again then tells which way it went. Messages
+ *     written while one sync is in progress share the next, so each waits
+ *     for at most two syncs.
+ *
+ *     A file that fails to sync may have lost what was written to it, so
+ *     once one does, every message written to it since that pass fails, and
+ *     wal_append refuses its topic from then on.
+ */
+int wal_park(wal_waiter *w);
+
+#endif
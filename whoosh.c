@@ -1,130 +1,751 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <poll.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include "csapp.h"
 #include "ast.h"
 #include "fail.h"
+#include "script_cache.h"
+
+/* The wait status of a command that exited with code */
+#define EXIT_STATUS(code) ((code) << 8)
+
+/* The wait status recorded for a command that could not be started,
+   which reads as an exit with status 127 like in other shells */
+#define SPAWN_FAILED_STATUS EXIT_STATUS(127)
+
+/* The wait status recorded for a command or builtin cut short by Ctrl-C or
+   the group timeout: killed by SIGTERM, which is what the commands are sent */
+#define STOPPED_STATUS SIGTERM
+
+/* How long a stopped command gets to exit after SIGTERM before SIGKILL */
+#define KILL_GRACE_MS 1000
+
+/* Flags for wait_commands */
+#define WAIT_STOP_ON_FIRST 1   /* stop the other commands once one exits */
+#define WAIT_STOP_NOW 2        /* stop every command straight away */
+
+/* The epoll tags for signal_fd and stop_fd, which can't be the index of a command */
+#define SIGNAL_EVENT ((uint32_t)-1)
+#define STOP_EVENT ((uint32_t)-2)
+
+/* Most epoll events to take at once */
+#define MAX_EVENTS 16
+
+/* Buffer size for the cat builtin */
+#define BUILTIN_BUFFER_SIZE 65536
+
+/* A program that whoosh runs itself instead of starting a process. handles
+   says whether the builtin can stand in for the program with the given
+   arguments, where in_fd is -1 if the command would read whoosh's own stdin;
+   run does the work and returns a wait status as the program would have. */
+typedef struct {
+  const char *program;
+  int (*handles)(int argc, const char **argv, int in_fd);
+  int (*run)(int argc, const char **argv, int in_fd, int out_fd);
+} builtin;
+
+/* A builtin running as one stage of a pipeline, on its own thread. Its fds
+   are private copies that the thread closes when it is done, or -1 for
+   whoosh's own stdin or stdout. */
+typedef struct {
+  const builtin *b;
+  int argc;
+  const char **argv;
+  int in_fd;
+  int out_fd;
+  int status;
+  pthread_t thread;
+} builtin_stage;
+
+/* What the commands of a group used, summed over every run of the group.
+   Builtins run inside whoosh, so only their runs show up here. */
+typedef struct {
+  int runs;
+  int commands;       /* commands reaped */
+  long wall_us;       /* time spent running the group */
+  long user_us;       /* CPU time of its commands */
+  long sys_us;
+  long max_rss_kb;    /* largest peak RSS of any one command */
+  long nvcsw;         /* voluntary and involuntary context switches */
+  long nivcsw;
+} group_profile;
+
+/* Kinds of worker_report */
+#define REPORT_VAR 0
+#define REPORT_PROFILE 1
+
+/* A variable assignment made in a worker process, replayed by its parent,
+   or the profile of the work it did, sent just before it exits */
+typedef struct {
+  int kind;
+  union {
+    struct {
+      script_var *var;
+      int value;
+    } var;
+    group_profile profile;
+  } u;
+} worker_report;
+
+/* A worker process running one group of a parallel script, or one
+   iteration of a parallel repeat; task is the group or iteration number */
+typedef struct {
+  pid_t pid;
+  int fd;
+  int task;
+} worker;
+
+/* For a parallel repeat, the latest iteration whose value each assigned
+   variable holds */
+typedef struct {
+  int num_vars;
+  script_var **vars;
+  int *iterations;
+} repeat_state;
 
 static void run_script(script *scr);
+static void run_script_parallel(script *scr);
+static int groups_conflict(script_group *a, script_group *b);
+static int group_writes(script_group *group, script_var *var);
+static int group_reads(script_group *group, script_var *var);
+static void setup_events(void);
+static pid_t start_worker(int *fd);
+static int wait_for_worker(worker *workers, int running, struct pollfd *fds,
+                           void (*apply)(int task, worker_report *report, void *data),
+                           void *data);
+static void apply_group_report(int task, worker_report *report, void *data);
+static void apply_repeat_report(int task, worker_report *report, void *data);
+static int read_report(int fd, worker_report *report);
 static void run_group(script_group *group);
+static void run_repeats_parallel(script_group *group);
+static int group_reads_own_writes(script_group *group);
+static void run_iteration(script_group *group);
 static void run_and_group(script_group *group);
 static void run_or_group(script_group *group);
-static void run_command(script_command *command);
+static void set_result(script_group *group, int status);
+static const char **build_argv(script_command *command, int *argc);
+static pid_t spawn_command(const char **argv, int in_fd, int out_fd,
+                           int (*pipes)[2], int num_pipes);
+static int wait_commands(pid_t *pids, int *statuses, int n, int flags);
+static void start_stop_window(void);
+static void stop_group(int sig);
+static int group_stop_signal(void);
+static void stop_commands(pid_t *pids, int *pidfds, int n, int sig);
+static void reap_command(pid_t pid, int *status);
+static void reap_stopped_command(pid_t pid, int *status);
+static long now_ms(void);
+static long now_us(void);
+static void add_rusage(group_profile *p, struct rusage *ru);
+static void add_profile(group_profile *to, group_profile *from);
+static void send_profile(void);
+static void print_profile(script *scr, long wall_us);
+static void print_json_string(FILE *f, const char *s);
+static const builtin *find_builtin(int argc, const char **argv, int in_fd);
+static void start_builtin_stage(builtin_stage *stage, int in_fd, int out_fd);
+static void *run_builtin_stage(void *arg);
+static int run_builtin(const builtin *b, int argc, const char **argv, int in_fd, int out_fd);
+static int builtin_handles_any(int argc, const char **argv, int in_fd);
+static int builtin_handles_echo(int argc, const char **argv, int in_fd);
+static int builtin_handles_cat(int argc, const char **argv, int in_fd);
+static int builtin_true(int argc, const char **argv, int in_fd, int out_fd);
+static int builtin_false(int argc, const char **argv, int in_fd, int out_fd);
+static int builtin_echo(int argc, const char **argv, int in_fd, int out_fd);
+static int builtin_cat(int argc, const char **argv, int in_fd, int out_fd);
+static int write_failed(const char *program, int err);
+static int write_all(int fd, const char *buf, size_t n);
+static int builtin_wait(int fd, short events);
 static void set_var(script_var *var, int new_value);
-static void ctrlc(int sig);
 
 static pid_t *pids;
-int len;
+
+/* most groups to run at once */
+static int max_jobs = 1;
+
+/* most iterations of a repeated group to run at once */
+static int max_repeat_jobs = 1;
+
+/* how long a group may run before it is stopped, -1 for no limit */
+static long group_timeout_ms = -1;
+
+/* SIGINT is blocked and read from here, without blocking, by whichever of
+   wait_commands and the builtins gets to it first */
+static int signal_fd = -1;
+
+/* The signal the running group is being stopped for, SIGINT for Ctrl-C or
+   SIGTERM for running out of time, or 0; changed atomically. stop_fd is
+   written when it is set, to wake wait_commands and the builtins. */
+static int stop_sig;
+static int stop_fd = -1;
+
+/* when the running group times out, -1 for never */
+static long group_deadline = -1;
+
+/* watches signal_fd, stop_fd, and the pidfds of the commands being waited on */
+static int epoll_fd = -1;
+
+/* where a worker process sends its variable assignments, -1 if not a worker */
+static int report_fd = -1;
+
+/* Profile output at exit */
+#define PROFILE_NONE 0
+#define PROFILE_TEXT 1
+#define PROFILE_JSON 2
+static int profile_format = PROFILE_NONE;
+
+/* one profile per group of the script when profiling, else NULL */
+static group_profile *profiles;
+
+/* the profile of the group this process is running, NULL when not profiling */
+static group_profile *profile;
+
+/* Programs run inside whoosh, by the path a script names them with */
+static const builtin builtins[] = {
+  { "/bin/true", builtin_handles_any, builtin_true },
+  { "/usr/bin/true", builtin_handles_any, builtin_true },
+  { "/bin/false", builtin_handles_any, builtin_false },
+  { "/usr/bin/false", builtin_handles_any, builtin_false },
+  { "/bin/echo", builtin_handles_echo, builtin_echo },
+  { "/usr/bin/echo", builtin_handles_echo, builtin_echo },
+  { "/bin/cat", builtin_handles_cat, builtin_cat },
+  { "/usr/bin/cat", builtin_handles_cat, builtin_cat },
+};
 
 int main(int argc, char **argv) {
   script *scr;
-  
-  if ((argc != 1) && (argc != 2)) {
-    fprintf(stderr, "usage: %s [<script-file>]\n", argv[0]);
+  int opt;
+  long start;
+
+  while ((opt = getopt(argc, argv, "j:r:t:pP")) != -1) {
+    if (opt == 'j' && atoi(optarg) > 0)
+      max_jobs = atoi(optarg);
+    else if (opt == 'r' && atoi(optarg) > 0)
+      max_repeat_jobs = atoi(optarg);
+    else if (opt == 't' && atoi(optarg) > 0)
+      group_timeout_ms = atoi(optarg) * 1000L;
+    else if (opt == 'p')
+      profile_format = PROFILE_TEXT;
+    else if (opt == 'P')
+      profile_format = PROFILE_JSON;
+    else {
+      fprintf(stderr, "usage: %s [-j <jobs>] [-r <repeat-jobs>] [-t <seconds>] [-p | -P] [<script-file>]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  if (argc - optind > 1) {
+    fprintf(stderr, "usage: %s [-j <jobs>] [-r <repeat-jobs>] [-t <seconds>] [-p | -P] [<script-file>]\n", argv[0]);
     exit(1);
   }
 
-  scr = parse_script_file((argc > 1) ? argv[1] : NULL);
+  scr = parse_script_cached((optind < argc) ? argv[optind] : NULL);
+
+  if (profile_format != PROFILE_NONE)
+    profiles = calloc(scr->num_groups, sizeof(group_profile));
 
+  start = now_us();
   run_script(scr);
+  if (profiles != NULL)
+    print_profile(scr, now_us() - start);
 
   return 0;
 }
 
 static void run_script(script *scr) {
-  Signal(SIGINT, ctrlc);
+  sigset_t sigs;
+
+  // Take SIGINT through signal_fd instead of a handler
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigprocmask(SIG_BLOCK, &sigs, NULL);
+  if ((signal_fd = signalfd(-1, &sigs, SFD_CLOEXEC | SFD_NONBLOCK)) < 0)
+    unix_error("signalfd error");
+  setup_events();
+
+  // A builtin writing to a closed pipe should fail with EPIPE, not kill us
+  Signal(SIGPIPE, SIG_IGN);
+  if (max_jobs > 1){
+    run_script_parallel(scr);
+    return;
+  }
   int i;
   int group_num = scr->num_groups;
   for (i=0; i<group_num; i++){
+    profile = profiles ? &profiles[i] : NULL;
     run_group(&scr->groups[i]);
   }
 }
 
-static void run_group(script_group *group) {
-
-  // Loop for handling repeats
-  int i, repeat_num = group->repeats;
-  for (i=0; i<repeat_num; i++) {
-
-    int j;
-    int commands_num = group->num_commands;
-    int child_status;
-    len = commands_num;
+/*
+ * run_script_parallel - runs up to max_jobs groups at once. A group waits for
+ * every earlier group that it conflicts with over a variable; each running
+ * group gets its own worker process, which reports its assignments back.
+ */
+static void run_script_parallel(script *scr) {
+  int i, j, group, num_groups = scr->num_groups;
+  int done = 0, running = 0, next = 0;
+  int *waiting_on = Malloc(num_groups*sizeof(int));
+  int *started = Malloc(num_groups*sizeof(int));
+  int **blocks = Malloc(num_groups*sizeof(int *));
+  int *num_blocks = Malloc(num_groups*sizeof(int));
+  worker *workers = Malloc(max_jobs*sizeof(worker));
+  struct pollfd *fds = Malloc((max_jobs+1)*sizeof(struct pollfd));
 
-    if (pids != NULL){
-      Free (pids);
+  // Build the dependency graph: blocks[i] lists the later groups that wait on group i
+  for (i=0; i<num_groups; i++){
+    waiting_on[i] = 0;
+    started[i] = 0;
+    blocks[i] = NULL;
+    num_blocks[i] = 0;
+  }
+  for (j=0; j<num_groups; j++){
+    for (i=0; i<j; i++){
+      if (groups_conflict(&scr->groups[i], &scr->groups[j])){
+        // Double the list whenever its length reaches a power of two
+        if ((num_blocks[i] & (num_blocks[i]-1)) == 0)
+          blocks[i] = realloc(blocks[i], (num_blocks[i] ? 2*num_blocks[i] : 1)*sizeof(int));
+        blocks[i][num_blocks[i]++] = j;
+        waiting_on[j]++;
+      }
     }
-    pids = Malloc(group->num_commands*sizeof(pid_t));
+  }
 
-    // If there is only a single command
-    if (group->mode == GROUP_SINGLE){
-      for (j=0; j<commands_num; j++ ){
-        pids[j] = Fork();
-        if (pids[j] == 0){
-          setpgid(0, 0);
-          run_command(&group->commands[j]);
+  while (done < num_groups){
+    // Start the earliest ready groups while there are free job slots
+    for (i=next; i<num_groups && running<max_jobs; i++){
+      if (!started[i] && waiting_on[i] == 0){
+        started[i] = 1;
+        workers[running].task = i;
+        profile = profiles ? &profiles[i] : NULL;
+        workers[running].pid = start_worker(&workers[running].fd);
+        if (workers[running].pid == 0){
+          run_group(&scr->groups[i]);
+          send_profile();
+          exit(0);
         }
-        Wait(&child_status);
+        running++;
       }
-      if (group->result_to != NULL){
-        // If the command was interrupted with a signal
-        if (WIFSIGNALED(child_status)){
-          set_var(group->result_to, -WTERMSIG(child_status));
-        }
-        // If the command exited with an error
-        if (WIFEXITED(child_status)){
-          set_var(group->result_to, WEXITSTATUS(child_status));
-        }
+    }
+    while (next < num_groups && started[next])
+      next++;
+
+    // Wait for a worker to finish, then release the groups waiting on it
+    i = wait_for_worker(workers, running, fds, apply_group_report, NULL);
+    group = workers[i].task;
+    for (j=0; j<num_blocks[group]; j++)
+      waiting_on[blocks[group][j]]--;
+    workers[i] = workers[--running];
+    done++;
+  }
+
+  for (i=0; i<num_groups; i++)
+    free(blocks[i]);
+  Free(blocks);
+  Free(num_blocks);
+  Free(waiting_on);
+  Free(started);
+  Free(workers);
+  Free(fds);
+}
+
+/*
+ * groups_conflict - true if group b has to wait for group a: one of them
+ * assigns a variable that the other reads or assigns
+ */
+static int groups_conflict(script_group *a, script_group *b) {
+  int i, j;
+  script_group *groups[2] = { a, b };
+
+  for (i=0; i<2; i++){
+    script_group *g = groups[i], *other = groups[1-i];
+    if (g->result_to != NULL
+        && (group_writes(other, g->result_to) || group_reads(other, g->result_to)))
+      return 1;
+    for (j=0; j<g->num_commands; j++){
+      script_var *var = g->commands[j].pid_to;
+      if (var != NULL && (group_writes(other, var) || group_reads(other, var)))
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * group_writes - true if the group assigns var, through result_to or a pid_to
+ */
+static int group_writes(script_group *group, script_var *var) {
+  int i;
+
+  if (group->result_to == var)
+    return 1;
+  for (i=0; i<group->num_commands; i++){
+    if (group->commands[i].pid_to == var)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * group_reads - true if any command of the group takes var as an argument
+ */
+static int group_reads(script_group *group, script_var *var) {
+  int i, j;
+
+  for (i=0; i<group->num_commands; i++){
+    script_command *command = &group->commands[i];
+    for (j=0; j<command->num_arguments; j++){
+      if (command->arguments[j].kind != ARGUMENT_LITERAL
+          && command->arguments[j].u.var == var)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * setup_events - creates this process's epoll set and stop_fd, watching
+ * signal_fd and stop_fd. stop_fd is edge-triggered, since it is only ever
+ * read to keep its count down.
+ */
+static void setup_events(void) {
+  struct epoll_event ev;
+
+  if (epoll_fd >= 0)
+    Close(epoll_fd);
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    unix_error("epoll_create1 error");
+  if (stop_fd >= 0)
+    Close(stop_fd);
+  if ((stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    unix_error("eventfd error");
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = SIGNAL_EVENT;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u32 = STOP_EVENT;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+}
+
+/*
+ * start_worker - forks a worker process. In the worker, returns 0 with
+ * set_var reporting to the parent, an epoll set of its own and an empty
+ * profile to send with send_profile; in the parent, returns the worker's
+ * pid and stores the end of the pipe its reports arrive on in *fd.
+ */
+static pid_t start_worker(int *fd) {
+  int fds[2];
+  pid_t pid;
+
+  // Commands the worker runs mustn't hold the pipe open: its end is how we
+  // learn that the worker is done
+  Pipe(fds);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  fflush(NULL);
+  pid = Fork();
+  if (pid == 0){
+    Close(fds[0]);
+    report_fd = fds[1];
+    setup_events();
+    if (profile != NULL)
+      memset(profile, 0, sizeof(group_profile));
+    return 0;
+  }
+
+  Close(fds[1]);
+  *fd = fds[0];
+  return pid;
+}
+
+/*
+ * wait_for_worker - waits until one of the running workers exits, applying
+ * the assignments reported along the way. Returns the index of the finished
+ * worker, which has been reaped. The workers share our process group, so
+ * they see Ctrl-C themselves; here it is only taken off signal_fd so that it
+ * doesn't stop the next group we run. fds has room for running+1 entries.
+ */
+static int wait_for_worker(worker *workers, int running, struct pollfd *fds,
+                           void (*apply)(int task, worker_report *report, void *data),
+                           void *data) {
+  int i;
+  worker_report report;
+  struct signalfd_siginfo info;
+
+  while (1){
+    for (i=0; i<running; i++){
+      fds[i].fd = workers[i].fd;
+      fds[i].events = POLLIN;
+    }
+    fds[running].fd = signal_fd;
+    fds[running].events = POLLIN;
+    if (poll(fds, running+1, -1) < 0)
+      continue;
+
+    if (fds[running].revents && read(signal_fd, &info, sizeof(info)) < 0 && errno != EAGAIN)
+      perror("signalfd");
+
+    for (i=0; i<running; i++){
+      if (!fds[i].revents)
+        continue;
+      if (read_report(workers[i].fd, &report)){
+        apply(workers[i].task, &report, data);
+        continue;
       }
+
+      // The worker closed its end, so it is done
+      Close(workers[i].fd);
+      Waitpid(workers[i].pid, NULL, 0);
+      return i;
+    }
+  }
+}
+
+/*
+ * apply_group_report - groups that could conflict never run together, so
+ * their assignments apply as they come
+ */
+static void apply_group_report(int task, worker_report *report, void *data) {
+  if (report->kind == REPORT_PROFILE)
+    add_profile(&profiles[task], &report->u.profile);
+  else
+    set_var(report->u.var.var, report->u.var.value);
+}
+
+/*
+ * apply_repeat_report - iterations finish in any order, so an assignment only
+ * applies if it comes from the latest iteration to assign the variable yet.
+ * That leaves each variable as the final iteration would have in sequence.
+ */
+static void apply_repeat_report(int task, worker_report *report, void *data) {
+  repeat_state *state = data;
+  script_var *var = report->u.var.var;
+  int i;
+
+  // Every iteration counts towards the group's profile
+  if (report->kind == REPORT_PROFILE){
+    add_profile(profile, &report->u.profile);
+    return;
+  }
+
+  for (i=0; i<state->num_vars; i++){
+    if (state->vars[i] == var)
+      break;
+  }
+  if (i == state->num_vars){
+    state->vars[state->num_vars] = var;
+    state->iterations[state->num_vars++] = task;
+  }
+  else if (task < state->iterations[i])
+    return;
+
+  state->iterations[i] = task;
+  set_var(var, report->u.var.value);
+}
+
+/*
+ * read_report - reads one report from a worker, returning 0 once the
+ * worker has closed its end
+ */
+static int read_report(int fd, worker_report *report) {
+  ssize_t n;
+
+  while ((n = read(fd, report, sizeof(*report))) < 0 && errno == EINTR)
+    ;
+  return n == sizeof(*report);
+}
+
+static void run_group(script_group *group) {
+  int i, repeat_num = group->repeats;
+  long start = now_us();
+
+  // Every iteration reuses the same pid list
+  if (pids != NULL){
+    Free (pids);
+  }
+  pids = Malloc(group->num_commands*sizeof(pid_t));
+
+  // Iterations can overlap unless one reads what another assigns
+  if (max_repeat_jobs > 1 && repeat_num > 1 && !group_reads_own_writes(group)){
+    run_repeats_parallel(group);
+  }
+
+  // Loop for handling repeats
+  else{
+    for (i=0; i<repeat_num; i++) {
+      run_iteration(group);
     }
+  }
+
+  if (profile != NULL)
+    profile->wall_us += now_us() - start;
+}
+
+/*
+ * run_repeats_parallel - keeps up to max_repeat_jobs iterations of a group
+ * running at once, each in its own worker, starting another as each exits
+ */
+static void run_repeats_parallel(script_group *group) {
+  int i, started = 0, running = 0;
+  int slots = (max_repeat_jobs < group->repeats) ? max_repeat_jobs : group->repeats;
+  worker *workers = Malloc(slots*sizeof(worker));
+  struct pollfd *fds = Malloc((slots+1)*sizeof(struct pollfd));
+  repeat_state state;
+
+  state.num_vars = 0;
+  state.vars = Malloc((group->num_commands+1)*sizeof(script_var *));
+  state.iterations = Malloc((group->num_commands+1)*sizeof(int));
 
-    // If the group is piped together
-    else if (group->mode == GROUP_AND){
-      run_and_group(group);
+  while (started < group->repeats || running > 0){
+    while (started < group->repeats && running < slots){
+      workers[running].task = started++;
+      workers[running].pid = start_worker(&workers[running].fd);
+      if (workers[running].pid == 0){
+        run_iteration(group);
+        send_profile();
+        exit(0);
+      }
+      running++;
     }
 
-    // If the group is an OR_GROUP
-    else if (group->mode == GROUP_OR) {
-      run_or_group(group);
+    i = wait_for_worker(workers, running, fds, apply_repeat_report, &state);
+    workers[i] = workers[--running];
+  }
+
+  Free(state.vars);
+  Free(state.iterations);
+  Free(workers);
+  Free(fds);
+}
+
+/*
+ * group_reads_own_writes - true if a command of the group takes a variable
+ * that the group assigns, so each iteration can depend on the one before
+ */
+static int group_reads_own_writes(script_group *group) {
+  int i;
+
+  if (group->result_to != NULL && group_reads(group, group->result_to))
+    return 1;
+  for (i=0; i<group->num_commands; i++){
+    if (group->commands[i].pid_to != NULL && group_reads(group, group->commands[i].pid_to))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * run_iteration - runs every command of a group once
+ */
+static void run_iteration(script_group *group) {
+  int j;
+  int commands_num = group->num_commands;
+  int child_status = 0;
+
+  if (profile != NULL)
+    profile->runs++;
+  start_stop_window();
+
+  // If there is only a single command
+  if (group->mode == GROUP_SINGLE){
+    for (j=0; j<commands_num && !group_stop_signal(); j++ ){
+      int argc;
+      const char **argv = build_argv(&group->commands[j], &argc);
+      const builtin *b = find_builtin(argc, argv, -1);
+      if (b != NULL){
+        pids[j] = 0;
+        child_status = run_builtin(b, argc, argv, 0, 1);
+      }
+      else{
+        pids[j] = spawn_command(argv, -1, -1, NULL, 0);
+        wait_commands(&pids[j], &child_status, 1, 0);
+      }
+      Free(argv);
     }
+    set_result(group, child_status);
+  }
+
+  // If the group is piped together
+  else if (group->mode == GROUP_AND){
+    run_and_group(group);
+  }
 
-  }// End loop for repeats
+  // If the group is an OR_GROUP
+  else if (group->mode == GROUP_OR) {
+    run_or_group(group);
+  }
 }
 
+/*
+ * run_or_group - starts every command of the group and keeps the status of
+ * the first to finish, stopping the rest. A builtin finishes as soon as it
+ * runs, so builtins run once everything else has started, and only the first
+ * of them unless a command failed to start.
+ */
 static void run_or_group(script_group *group){
   int i, status;
+  int commands_num = group->num_commands;
+  int first = -1;
+  int *statuses = Malloc(commands_num*sizeof(int));
+  int *argcs = Malloc(commands_num*sizeof(int));
+  const char ***argvs = Malloc(commands_num*sizeof(const char **));
+  const builtin **bs = Malloc(commands_num*sizeof(const builtin *));
 
-  for (i=0; i<group->num_commands; i++){
-    pids[i] = Fork();
-    if (pids[i] == 0){
-      setpgid(0, 0);
-      run_command(&group->commands[i]);
-    }
+  for (i=0; i<commands_num; i++){
+    argvs[i] = build_argv(&group->commands[i], &argcs[i]);
+    bs[i] = find_builtin(argcs[i], argvs[i], -1);
+    pids[i] = (bs[i] != NULL) ? 0 : spawn_command(argvs[i], -1, -1, NULL, 0);
     if (group->commands[i].pid_to != NULL){
       set_var(group->commands[i].pid_to, pids[i]);
     }
+    // A command that can't start is the first to finish
+    if (pids[i] < 0 && first < 0)
+      first = i;
   }
 
-  pid_t first = Wait(&status);
-  if (group->result_to != NULL){
-    if (WIFEXITED(status))
-      set_var(group->result_to, WEXITSTATUS(status));
-    else
-      set_var(group->result_to, -WTERMSIG(status));
-  }
-
-  for (i=0; i<group->num_commands; i++){
-    if (first != pids[i]){
-      Kill(pids[i], SIGTERM);
-      Waitpid(pids[i], &status, 0);
+  for (i=0; i<commands_num && first < 0; i++){
+    if (bs[i] != NULL){
+      statuses[i] = run_builtin(bs[i], argcs[i], argvs[i], 0, 1);
+      first = i;
     }
   }
+
+  // Race the commands, or stop them all if one has already finished
+  if (first < 0)
+    first = wait_commands(pids, statuses, commands_num, WAIT_STOP_ON_FIRST);
+  else
+    wait_commands(pids, statuses, commands_num, WAIT_STOP_NOW);
+  status = statuses[first];
+  set_result(group, status);
+
+  for (i=0; i<commands_num; i++)
+    Free(argvs[i]);
+  Free(statuses);
+  Free(argcs);
+  Free(argvs);
+  Free(bs);
 }
 
+/*
+ * run_and_group - pipes the commands of the group together, keeping the
+ * status of the last one. Builtin stages run on threads of their own.
+ */
 static void run_and_group(script_group *group){
 
   int j;
   int commands_num = group->num_commands;
   int child_status;
+  int *statuses = Malloc(commands_num*sizeof(int));
+  builtin_stage *stages = Malloc(commands_num*sizeof(builtin_stage));
 
   // An array of pipes
   int fds_arr[commands_num-1][2];
@@ -132,86 +753,70 @@ static void run_and_group(script_group *group){
     Pipe(fds_arr[j]);
   }
 
-  sigset_t sigs;
-  sigemptyset(&sigs);
-  sigaddset(&sigs, SIGINT);
-  sigprocmask(SIG_BLOCK, &sigs, NULL);
+  // Each command reads from the pipe before it and writes to the pipe after it
+  for (j=0; j<commands_num; j++){
+    int in_fd = (j > 0) ? fds_arr[j-1][0] : -1;
+    int out_fd = (j < commands_num-1) ? fds_arr[j][1] : -1;
 
-  // The first command
-  pids[0] = Fork();
-  if (pids[0] == 0){
-    setpgid(0, 0);
-    Dup2(fds_arr[0][1], 1);
-    int k;
-    for (k=0; k<commands_num-1; k++){
-      Close(fds_arr[k][0]);
-      Close(fds_arr[k][1]);
-    }
-    run_command(&group->commands[0]);
-  }
-  if (group->commands[0].pid_to != NULL){
-    set_var(group->commands[0].pid_to, pids[0]);
-  }
-
-  // All of the middle commands
-  for (j=1; j<commands_num-1; j++){
-    pids[j] = Fork();
-    if (pids[j] == 0){
-      setpgid(0, 0);
-      Dup2(fds_arr[j][1], 1);
-      Dup2(fds_arr[j-1][0], 0);
-      int k;
-      for (k=0; k<commands_num-1; k++){
-        Close(fds_arr[k][0]);
-        Close(fds_arr[k][1]);
-      }
-      run_command(&group->commands[j]);
+    stages[j].argv = build_argv(&group->commands[j], &stages[j].argc);
+    stages[j].b = find_builtin(stages[j].argc, stages[j].argv, in_fd);
+    if (stages[j].b != NULL){
+      start_builtin_stage(&stages[j], in_fd, out_fd);
+      pids[j] = 0;
     }
+    else
+      pids[j] = spawn_command(stages[j].argv, in_fd, out_fd, fds_arr, commands_num-1);
     if (group->commands[j].pid_to != NULL){
       set_var(group->commands[j].pid_to, pids[j]);
     }
   }
 
-  for (j=0; j<commands_num-2; j++){
+  for (j=0; j<commands_num-1; j++){
     Close(fds_arr[j][0]);
     Close(fds_arr[j][1]);
   }
 
-  // The last command
-  pids[commands_num-1] = Fork();
-  if (pids[commands_num-1] == 0){
-    setpgid(0,0);
-    Dup2(fds_arr[commands_num-2][0], 0);
-    Close(fds_arr[commands_num-2][0]);
-    Close(fds_arr[commands_num-2][1]);
-    run_command(&group->commands[commands_num-1]);
-  }
-  if (group->commands[commands_num-1].pid_to != NULL){
-    set_var(group->commands[commands_num-1].pid_to, pids[commands_num-1]);
-  }
-  Close(fds_arr[commands_num-2][0]);
-  Close(fds_arr[commands_num-2][1]);
-
-  sigprocmask(SIG_UNBLOCK, &sigs, NULL);
-
-  // Reap all the processes
+  // Reap all the processes, then the threads, which finish once the
+  // processes around them have
+  wait_commands(pids, statuses, commands_num, 0);
   for (j=0; j<commands_num; j++){
-    Waitpid(pids[j], &child_status, 0);
+    if (stages[j].b != NULL){
+      Pthread_join(stages[j].thread, NULL);
+      statuses[j] = stages[j].status;
+    }
+    Free(stages[j].argv);
   }
+  child_status = statuses[commands_num-1];
+  Free(statuses);
+  Free(stages);
 
-  if (group->result_to != NULL){
-    if (WIFEXITED(child_status))
-      set_var(group->result_to, WEXITSTATUS(child_status));
-    else
-      set_var(group->result_to, -WTERMSIG(child_status));
-  }
+  set_result(group, child_status);
+}
+
+/*
+ * set_result - stores the result of a run of a group in its result_to, if it
+ * has one: the exit status of the command it comes from, or minus the signal
+ * that killed it. A command or builtin cut short by Ctrl-C or the group
+ * timeout has STOPPED_STATUS, so gets minus SIGTERM.
+ */
+static void set_result(script_group *group, int status) {
+  if (group->result_to == NULL)
+    return;
+  if (WIFEXITED(status))
+    set_var(group->result_to, WEXITSTATUS(status));
+  else
+    set_var(group->result_to, -WTERMSIG(status));
 }
 
-static void run_command(script_command *command) {
+/*
+ * build_argv - builds the NULL-terminated argument list for a command from
+ * the current values of its variables, storing its length in *argc
+ */
+static const char **build_argv(script_command *command, int *argc) {
   const char **argv;
   int i;
 
-  argv = malloc(sizeof(char *) * (command->num_arguments + 2));
+  argv = Malloc(sizeof(char *) * (command->num_arguments + 2));
   argv[0] = command->program;
 
   for (i = 0; i < command->num_arguments; i++) {
@@ -223,17 +828,486 @@ static void run_command(script_command *command) {
   }
 
   argv[command->num_arguments + 1] = NULL;
+  *argc = command->num_arguments + 1;
+  return argv;
+}
 
-  Execve(argv[0], (char * const *)argv, environ);
+/*
+ * spawn_command - starts a command in its own process group without forking
+ * whoosh itself. in_fd and out_fd become its stdin and stdout unless they are
+ * -1, and both ends of every pipe in pipes are closed in the command. Returns
+ * the command's pid, or -1 if it could not be started.
+ */
+static pid_t spawn_command(const char **argv, int in_fd, int out_fd,
+                           int (*pipes)[2], int num_pipes) {
+  int i, err;
+  pid_t pid;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t none, pipe_sig;
 
-  free(argv);
+  posix_spawn_file_actions_init(&actions);
+  if (in_fd >= 0)
+    posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+  if (out_fd >= 0)
+    posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+  for (i = 0; i < num_pipes; i++) {
+    posix_spawn_file_actions_addclose(&actions, pipes[i][0]);
+    posix_spawn_file_actions_addclose(&actions, pipes[i][1]);
+  }
+
+  // Put the command in its own process group, without our blocked signals
+  // and with SIGPIPE back to its default
+  sigemptyset(&none);
+  sigemptyset(&pipe_sig);
+  sigaddset(&pipe_sig, SIGPIPE);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK
+                                  | POSIX_SPAWN_SETSIGDEF);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &pipe_sig);
+
+  err = posix_spawn(&pid, argv[0], &actions, &attr, (char * const *)argv, environ);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+    pid = -1;
+  }
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
+  return pid;
 }
 
-static void ctrlc(int sig){
+/*
+ * wait_commands - waits on the n commands of one run of a group, reaping
+ * each as its pidfd turns readable and storing its wait status in statuses.
+ * Entries of pids that are 0 have no process and are skipped; those below 0
+ * never started and get SPAWN_FAILED_STATUS. The commands are stopped, with
+ * SIGTERM and then SIGKILL after KILL_GRACE_MS, on Ctrl-C, once the group
+ * timeout passes, and as flags asks. Returns the index of the first command
+ * to exit, or -1 if there was none to wait on.
+ */
+static int wait_commands(pid_t *pids, int *statuses, int n, int flags) {
+  int i, k, count, first = -1, waiting = 0, stopping = 0;
+  int *pidfds = Malloc(n*sizeof(int));
+  long now, deadline = -1;
+  struct epoll_event ev, events[MAX_EVENTS];
+  struct signalfd_siginfo info;
+
+  for (i=0; i<n; i++){
+    pidfds[i] = -1;
+    if (pids[i] < 0)
+      statuses[i] = SPAWN_FAILED_STATUS;
+    if (pids[i] <= 0)
+      continue;
+
+    // Without pidfds (Linux before 5.3) the command is waited for below
+    if ((pidfds[i] = syscall(SYS_pidfd_open, pids[i], 0)) < 0){
+      pidfds[i] = -2;
+      continue;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfds[i], &ev) < 0)
+      unix_error("epoll_ctl error");
+    waiting++;
+  }
+
+  now = now_ms();
+  deadline = group_deadline;
+  if ((flags & WAIT_STOP_NOW) || group_stop_signal()){
+    stop_commands(pids, pidfds, n, SIGTERM);
+    stopping = 1;
+    deadline = now + KILL_GRACE_MS;
+  }
+
+  while (waiting > 0){
+    count = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                       (deadline < 0) ? -1 : (deadline > now) ? (int)(deadline - now) : 0);
+    if (count < 0 && errno != EINTR)
+      unix_error("epoll_wait error");
+    now = now_ms();
+
+    // Out of time: stop the group, and then make its commands stop
+    if (deadline >= 0 && now >= deadline){
+      if (!stopping)
+        stop_group(SIGTERM);
+      else{
+        stop_commands(pids, pidfds, n, SIGKILL);
+        deadline = -1;
+      }
+    }
+
+    for (k=0; k<count; k++){
+      // A builtin may have taken the signal first, and then told us on stop_fd
+      if (events[k].data.u32 == SIGNAL_EVENT){
+        if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+          stop_group(SIGINT);
+        continue;
+      }
+      if (events[k].data.u32 == STOP_EVENT)
+        continue;
+
+      i = events[k].data.u32;
+      reap_stopped_command(pids[i], &statuses[i]);
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pidfds[i], NULL);
+      Close(pidfds[i]);
+      pidfds[i] = -1;
+      waiting--;
+      if (first < 0)
+        first = i;
+
+      if ((flags & WAIT_STOP_ON_FIRST) && !stopping){
+        stop_commands(pids, pidfds, n, SIGTERM);
+        stopping = 1;
+        deadline = now + KILL_GRACE_MS;
+      }
+    }
+
+    if (!stopping && group_stop_signal()){
+      stop_commands(pids, pidfds, n, SIGTERM);
+      stopping = 1;
+      deadline = now + KILL_GRACE_MS;
+    }
+  }
+
+  for (i=0; i<n; i++){
+    if (pidfds[i] == -2){
+      reap_stopped_command(pids[i], &statuses[i]);
+      if (first < 0)
+        first = i;
+    }
+  }
+
+  Free(pidfds);
+  return first;
+}
+
+/*
+ * start_stop_window - starts a run of the running group: not stopped, and
+ * with the group timeout counting from now
+ */
+static void start_stop_window(void) {
+  uint64_t count;
+
+  __atomic_store_n(&stop_sig, 0, __ATOMIC_RELEASE);
+  if (read(stop_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+  group_deadline = (group_timeout_ms > 0) ? now_ms() + group_timeout_ms : -1;
+}
+
+/*
+ * stop_group - stops the running group for sig, unless it is already being
+ * stopped, waking wait_commands and any builtins so they stop too
+ */
+static void stop_group(int sig) {
+  int none = 0;
+  uint64_t one = 1;
+
+  if (!__atomic_compare_exchange_n(&stop_sig, &none, sig, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return;
+  if (sig == SIGTERM)
+    fprintf(stderr, "group timed out after %ld seconds\n", group_timeout_ms / 1000);
+  if (write(stop_fd, &one, sizeof(one)) < 0)
+    perror("eventfd");
+}
+
+/*
+ * group_stop_signal - the signal the running group is being stopped for, or 0
+ */
+static int group_stop_signal(void) {
+  return __atomic_load_n(&stop_sig, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * stop_commands - sends sig to every command that wait_commands hasn't
+ * reaped yet. Their pids can't have been reused, since they are unreaped.
+ */
+static void stop_commands(pid_t *pids, int *pidfds, int n, int sig) {
   int i;
-  for (i=0; i<len; i++){
-    Kill(pids[i], SIGTERM);
+
+  for (i=0; i<n; i++){
+    if (pidfds[i] != -1)
+      kill(pids[i], sig);
+  }
+}
+
+/*
+ * reap_command - waits for a command that has exited or is about to,
+ * adding what it used to the current group's profile
+ */
+static void reap_command(pid_t pid, int *status) {
+  struct rusage ru;
+
+  while (wait4(pid, status, 0, &ru) < 0){
+    if (errno != EINTR)
+      unix_error("wait4 error");
   }
+  if (profile != NULL){
+    profile->commands++;
+    add_rusage(profile, &ru);
+  }
+}
+
+/*
+ * reap_stopped_command - reaps a command like reap_command, but if the group
+ * is being stopped and the command exited rather than being killed, records
+ * STOPPED_STATUS: it most likely exited on EOF from a neighbour that was
+ * stopped, and wasn't left to finish in any case
+ */
+static void reap_stopped_command(pid_t pid, int *status) {
+  reap_command(pid, status);
+  if (group_stop_signal() && WIFEXITED(*status))
+    *status = STOPPED_STATUS;
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * find_builtin - the builtin that can run a command with these arguments in
+ * place of its program, or NULL if it needs a process of its own
+ */
+static const builtin *find_builtin(int argc, const char **argv, int in_fd) {
+  size_t i;
+
+  for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (strcmp(argv[0], builtins[i].program) == 0)
+      return builtins[i].handles(argc, argv, in_fd) ? &builtins[i] : NULL;
+  }
+  return NULL;
+}
+
+/*
+ * start_builtin_stage - runs a builtin pipeline stage on a new thread. The
+ * thread gets its own close-on-exec copies of its pipe ends, so the caller
+ * can close the pipes and commands started later don't hold them open.
+ */
+static void start_builtin_stage(builtin_stage *stage, int in_fd, int out_fd) {
+  stage->in_fd = (in_fd >= 0) ? fcntl(in_fd, F_DUPFD_CLOEXEC, 3) : -1;
+  stage->out_fd = (out_fd >= 0) ? fcntl(out_fd, F_DUPFD_CLOEXEC, 3) : -1;
+  Pthread_create(&stage->thread, NULL, run_builtin_stage, stage);
+}
+
+static void *run_builtin_stage(void *arg) {
+  builtin_stage *stage = arg;
+
+  stage->status = run_builtin(stage->b, stage->argc, stage->argv,
+                              (stage->in_fd >= 0) ? stage->in_fd : 0,
+                              (stage->out_fd >= 0) ? stage->out_fd : 1);
+
+  // Closing our ends lets the stages either side see EOF or EPIPE
+  if (stage->in_fd >= 0)
+    close(stage->in_fd);
+  if (stage->out_fd >= 0)
+    close(stage->out_fd);
+  return NULL;
+}
+
+/*
+ * run_builtin - runs a builtin, returning its wait status, or STOPPED_STATUS
+ * if the group was stopped by the time it finished: a builtin that saw EOF
+ * from a stopped neighbour would otherwise look like it ran to the end
+ */
+static int run_builtin(const builtin *b, int argc, const char **argv, int in_fd, int out_fd) {
+  int status = b->run(argc, argv, in_fd, out_fd);
+
+  return group_stop_signal() ? STOPPED_STATUS : status;
+}
+
+static int builtin_handles_any(int argc, const char **argv, int in_fd) {
+  return 1;
+}
+
+/*
+ * builtin_handles_echo - the builtin knows -n, but leaves any other option
+ * to the real program
+ */
+static int builtin_handles_echo(int argc, const char **argv, int in_fd) {
+  int i = (argc > 1 && strcmp(argv[1], "-n") == 0) ? 2 : 1;
+  return i >= argc || argv[i][0] != '-' || argv[i][1] == '\0';
+}
+
+/*
+ * builtin_handles_cat - the builtin takes no options, and doesn't read
+ * whoosh's own stdin, which Ctrl-C could not get it out of
+ */
+static int builtin_handles_cat(int argc, const char **argv, int in_fd) {
+  int i;
+
+  if (argc == 1)
+    return in_fd >= 0;
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && (argv[i][1] != '\0' || in_fd < 0))
+      return 0;
+  }
+  return 1;
+}
+
+static int builtin_true(int argc, const char **argv, int in_fd, int out_fd) {
+  return EXIT_STATUS(0);
+}
+
+static int builtin_false(int argc, const char **argv, int in_fd, int out_fd) {
+  return EXIT_STATUS(1);
+}
+
+/*
+ * builtin_echo - writes the arguments in a single write, like echo would
+ * with a buffered stdout
+ */
+static int builtin_echo(int argc, const char **argv, int in_fd, int out_fd) {
+  int i, first = 1, newline = 1;
+  size_t n = 0, size = 1;
+  char *buf;
+  int err;
+
+  if (argc > 1 && strcmp(argv[1], "-n") == 0){
+    newline = 0;
+    first = 2;
+  }
+  for (i = first; i < argc; i++)
+    size += strlen(argv[i]) + 1;
+
+  buf = Malloc(size);
+  for (i = first; i < argc; i++){
+    if (i > first)
+      buf[n++] = ' ';
+    strcpy(buf + n, argv[i]);
+    n += strlen(argv[i]);
+  }
+  if (newline)
+    buf[n++] = '\n';
+
+  err = write_all(out_fd, buf, n);
+  Free(buf);
+  return write_failed(argv[0], err);
+}
+
+/*
+ * builtin_cat - copies each file, or in_fd for "-" or no files at all, to out_fd.
+ * It can go on for ever, so it waits for each read and write with
+ * builtin_wait, and if the group is stopped returns STOPPED_STATUS as a
+ * process would have been killed.
+ */
+static int builtin_cat(int argc, const char **argv, int in_fd, int out_fd) {
+  char *buf = Malloc(BUILTIN_BUFFER_SIZE);
+  int i, fd, err, sig = 0, status = 0;
+  ssize_t n;
+
+  for (i = (argc > 1) ? 1 : 0; i < argc; i++){
+    if (i == 0 || strcmp(argv[i], "-") == 0)
+      fd = in_fd;
+    else if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0){
+      fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    while ((sig = builtin_wait(fd, POLLIN)) == 0
+           && (n = read(fd, buf, BUILTIN_BUFFER_SIZE)) != 0){
+      if (n < 0){
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        fprintf(stderr, "%s: %s: %s\n", argv[0], (i == 0) ? "-" : argv[i], strerror(errno));
+        status = 1;
+        break;
+      }
+      // Once there is room, the write only blocks for as long as whatever
+      // reads the other end takes to read or, being stopped, to close it
+      if ((sig = builtin_wait(out_fd, POLLOUT)) != 0)
+        break;
+      if ((err = write_all(out_fd, buf, n)) != 0){
+        if (fd != in_fd)
+          close(fd);
+        Free(buf);
+        return write_failed(argv[0], err);
+      }
+    }
+
+    if (fd != in_fd)
+      close(fd);
+    if (sig != 0)
+      break;
+  }
+
+  Free(buf);
+  return (sig != 0) ? STOPPED_STATUS : EXIT_STATUS(status);
+}
+
+/*
+ * builtin_wait - waits until fd is ready for events, returning 0, or the
+ * signal the group is being stopped for if that comes first. Builtins have
+ * no process for wait_commands to stop, so this watches for Ctrl-C and the
+ * group timeout itself.
+ */
+static int builtin_wait(int fd, short events) {
+  struct pollfd fds[3];
+  struct signalfd_siginfo info;
+  long now;
+  int sig;
+
+  while ((sig = group_stop_signal()) == 0){
+    fds[0].fd = fd;
+    fds[0].events = events;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = signal_fd;
+    fds[2].events = POLLIN;
+    now = now_ms();
+    if (poll(fds, 3, (group_deadline < 0) ? -1
+                     : (group_deadline > now) ? (int)(group_deadline - now) : 0) < 0){
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+
+    if ((fds[2].revents & POLLIN) && read(signal_fd, &info, sizeof(info)) == sizeof(info))
+      stop_group(SIGINT);
+    else if (group_deadline >= 0 && now_ms() >= group_deadline)
+      stop_group(SIGTERM);
+    else if (fds[0].revents)
+      return 0;
+  }
+  return sig;
+}
+
+/*
+ * write_failed - the wait status of a builtin whose output failed with err.
+ * A real program would have been killed by SIGPIPE writing to a closed pipe,
+ * so that is what the builtin reports, quietly.
+ */
+static int write_failed(const char *program, int err) {
+  if (err == 0)
+    return EXIT_STATUS(0);
+  if (err == EPIPE)
+    return SIGPIPE;
+  fprintf(stderr, "%s: write error: %s\n", program, strerror(err));
+  return EXIT_STATUS(1);
+}
+
+/*
+ * write_all - writes all n bytes, returning 0 or the errno of the failed write
+ */
+static int write_all(int fd, const char *buf, size_t n) {
+  ssize_t written;
+
+  while (n > 0){
+    if ((written = write(fd, buf, n)) < 0){
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    buf += written;
+    n -= written;
+  }
+  return 0;
 }
 
 static void set_var(script_var *var, int new_value) {
@@ -241,4 +1315,121 @@ static void set_var(script_var *var, int new_value) {
   free((void *)var->value);
   snprintf(buffer, sizeof(buffer), "%d", new_value);
   var->value = strdup(buffer);
-}
\ No newline at end of file
+
+  // A worker also passes the assignment up to its parent
+  if (report_fd >= 0){
+    worker_report report;
+    report.kind = REPORT_VAR;
+    report.u.var.var = var;
+    report.u.var.value = new_value;
+    if (write(report_fd, &report, sizeof(report)) != sizeof(report))
+      perror("report");
+  }
+}
+
+static long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void add_rusage(group_profile *p, struct rusage *ru) {
+  p->user_us += ru->ru_utime.tv_sec * 1000000L + ru->ru_utime.tv_usec;
+  p->sys_us += ru->ru_stime.tv_sec * 1000000L + ru->ru_stime.tv_usec;
+  if (ru->ru_maxrss > p->max_rss_kb)
+    p->max_rss_kb = ru->ru_maxrss;
+  p->nvcsw += ru->ru_nvcsw;
+  p->nivcsw += ru->ru_nivcsw;
+}
+
+static void add_profile(group_profile *to, group_profile *from) {
+  to->runs += from->runs;
+  to->commands += from->commands;
+  to->wall_us += from->wall_us;
+  to->user_us += from->user_us;
+  to->sys_us += from->sys_us;
+  if (from->max_rss_kb > to->max_rss_kb)
+    to->max_rss_kb = from->max_rss_kb;
+  to->nvcsw += from->nvcsw;
+  to->nivcsw += from->nivcsw;
+}
+
+/*
+ * send_profile - a worker passes the profile of its work up to its parent
+ */
+static void send_profile(void) {
+  worker_report report;
+
+  if (profile == NULL || report_fd < 0)
+    return;
+  report.kind = REPORT_PROFILE;
+  report.u.profile = *profile;
+  if (write(report_fd, &report, sizeof(report)) != sizeof(report))
+    perror("report");
+}
+
+/*
+ * print_profile - prints the profile of every group and of the whole script
+ * to stderr, as a table or as JSON. Groups are named by their first command.
+ * The script's wall time is from start to end, so with -j it is less than
+ * the sum over the groups.
+ */
+static void print_profile(script *scr, long wall_us) {
+  group_profile total;
+  int i;
+
+  memset(&total, 0, sizeof(total));
+  for (i=0; i<scr->num_groups; i++)
+    add_profile(&total, &profiles[i]);
+  total.wall_us = wall_us;
+
+  if (profile_format == PROFILE_JSON){
+    fprintf(stderr, "{\"groups\": [");
+    for (i=0; i<=scr->num_groups; i++){
+      group_profile *p = (i < scr->num_groups) ? &profiles[i] : &total;
+      if (i == scr->num_groups)
+        fprintf(stderr, "], \"script\": {");
+      else{
+        fprintf(stderr, "%s{\"group\": %d, \"program\": ", i ? ", " : "", i);
+        print_json_string(stderr, scr->groups[i].num_commands
+                                  ? scr->groups[i].commands[0].program : "");
+        fprintf(stderr, ", ");
+      }
+      fprintf(stderr, "\"runs\": %d, \"commands\": %d, \"wall_ms\": %.3f, "
+              "\"user_ms\": %.3f, \"sys_ms\": %.3f, \"max_rss_kb\": %ld, "
+              "\"voluntary_switches\": %ld, \"involuntary_switches\": %ld}",
+              p->runs, p->commands, p->wall_us / 1e3, p->user_us / 1e3, p->sys_us / 1e3,
+              p->max_rss_kb, p->nvcsw, p->nivcsw);
+    }
+    fprintf(stderr, "}\n");
+    return;
+  }
+
+  fprintf(stderr, "%5s %-24s %6s %6s %11s %11s %11s %10s %8s %8s\n",
+          "group", "program", "runs", "cmds", "wall ms", "user ms", "sys ms",
+          "rss kB", "vcsw", "ivcsw");
+  for (i=0; i<=scr->num_groups; i++){
+    group_profile *p = (i < scr->num_groups) ? &profiles[i] : &total;
+    if (i < scr->num_groups)
+      fprintf(stderr, "%5d %-24.24s", i, scr->groups[i].num_commands
+                                         ? scr->groups[i].commands[0].program : "");
+    else
+      fprintf(stderr, "%5s %-24s", "", "total");
+    fprintf(stderr, " %6d %6d %11.3f %11.3f %11.3f %10ld %8ld %8ld\n",
+            p->runs, p->commands, p->wall_us / 1e3, p->user_us / 1e3, p->sys_us / 1e3,
+            p->max_rss_kb, p->nvcsw, p->nivcsw);
+  }
+}
+
+static void print_json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++){
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", *s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
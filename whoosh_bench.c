@@ -0,0 +1,533 @@
+/*
+ * whoosh_bench.c - Measures what whoosh adds on top of the commands it runs.
+ *     Generates scripts of single commands, pipelines of increasing length,
+ *     OR-group races and repeated groups, runs whoosh on each and reports
+ *     commands per second, the gap between one command exiting and the next
+ *     one starting, and how fast data moves through a pipeline.
+ *
+ * Build with:
+ *     cc -O2 -o whoosh_bench whoosh_bench.c
+ * and run with the whoosh to measure, plus any options to pass on to it:
+ *     ./whoosh_bench [-w <whoosh>] [-n <commands>] [-b <pipe-bytes>] [-k] [-- <whoosh options>]
+ *
+ * The commands in the scripts are this same program, run through symlinks
+ * named after the stand-in they should act as, so that the numbers don't
+ * depend on what happens to be installed in /bin.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/* How the script syntax spells each construct; keep in step with the parser */
+#define SYNTAX_AND " && "
+#define SYNTAX_OR " || "
+#define SYNTAX_REPEAT "repeat %d "
+#define SYNTAX_RESULT " -> $%s"
+
+/* Buffer size for the stand-ins that move data */
+#define IO_BUFFER_SIZE 65536
+
+/* A program that the generated scripts run, by the name of its symlink */
+typedef struct {
+  const char *name;
+  int (*main)(int argc, char **argv);
+} stand_in;
+
+static int stand_in_noop(int argc, char **argv);
+static int stand_in_stamp(int argc, char **argv);
+static int stand_in_produce(int argc, char **argv);
+static int stand_in_pass(int argc, char **argv);
+static int stand_in_consume(int argc, char **argv);
+static int stand_in_sleep(int argc, char **argv);
+
+static void make_stand_ins(const char *self);
+static void remove_stand_ins(void);
+static FILE *open_script(const char *name, char *path);
+static double run_whoosh(const char *script_path);
+static void bench_single(int n);
+static void bench_latency(int n);
+static void bench_pipeline(int stages);
+static void bench_race(int n, int width);
+static void bench_repeat(int n, const char *program, const char *label);
+static void report(const char *name, long commands, double seconds, const char *extra);
+static int compare_longs(const void *a, const void *b);
+static long now_ns(void);
+
+static stand_in stand_ins[] = {
+  { "noop", stand_in_noop },
+  { "stamp", stand_in_stamp },
+  { "produce", stand_in_produce },
+  { "pass", stand_in_pass },
+  { "consume", stand_in_consume },
+  { "sleep", stand_in_sleep },
+};
+
+#define NUM_STAND_INS (sizeof(stand_ins) / sizeof(stand_ins[0]))
+
+/* the whoosh being measured, and the options it is run with */
+static const char *whoosh = "./whoosh";
+static char **whoosh_options;
+static int num_whoosh_options;
+
+/* where the stand-ins and scripts go */
+static char work_dir[] = "/tmp/whoosh_bench.XXXXXX";
+
+/* bytes pushed through each pipeline */
+static long pipe_bytes = 64L << 20;
+
+int main(int argc, char **argv)
+{
+  const char *name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  char self[PATH_MAX];
+  int opt, keep = 0, n = 1000;
+  size_t i;
+  ssize_t len;
+
+  // Run as a stand-in when called through one of the symlinks
+  for (i = 0; i < NUM_STAND_INS; i++)
+  {
+    if (strcmp(name, stand_ins[i].name) == 0)
+      return stand_ins[i].main(argc, argv);
+  }
+
+  while ((opt = getopt(argc, argv, "w:n:b:k")) != -1)
+  {
+    switch (opt)
+    {
+    case 'w':
+      whoosh = optarg;
+      break;
+    case 'n':
+      n = atoi(optarg);
+      break;
+    case 'b':
+      pipe_bytes = atol(optarg);
+      break;
+    case 'k':
+      keep = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-w <whoosh>] [-n <commands>] [-b <pipe-bytes>] [-k] [-- <whoosh options>]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  if (n < 10 || pipe_bytes < 1)
+  {
+    fprintf(stderr, "usage: %s [-w <whoosh>] [-n <commands>] [-b <pipe-bytes>] [-k] [-- <whoosh options>]\n", argv[0]);
+    exit(1);
+  }
+  whoosh_options = argv + optind;
+  num_whoosh_options = argc - optind;
+
+  if ((len = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0)
+  {
+    perror("/proc/self/exe");
+    exit(1);
+  }
+  self[len] = '\0';
+
+  if (mkdtemp(work_dir) == NULL)
+  {
+    perror(work_dir);
+    exit(1);
+  }
+  make_stand_ins(self);
+
+  printf("%-22s %9s %9s %12s  %s\n", "benchmark", "commands", "seconds", "commands/s", "");
+
+  bench_single(n);
+  bench_latency(n);
+  bench_pipeline(2);
+  bench_pipeline(4);
+  bench_pipeline(8);
+  bench_pipeline(16);
+  bench_race(n / 10, 2);
+  bench_race(n / 10, 8);
+  bench_repeat(n, "noop", "repeat");
+  bench_repeat(n, "/bin/true", "repeat /bin/true");
+
+  if (keep)
+    printf("scripts kept in %s\n", work_dir);
+  else
+    remove_stand_ins();
+  return 0;
+}
+
+static int stand_in_noop(int argc, char **argv)
+{
+  return 0;
+}
+
+/*
+ * stand_in_stamp - appends the time it started and the time it is about to
+ * exit to the file named by its argument
+ */
+static int stand_in_stamp(int argc, char **argv)
+{
+  long start = now_ns();
+  char line[64];
+  int fd, n;
+
+  if (argc < 2 || (fd = open(argv[1], O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+    return 1;
+  n = snprintf(line, sizeof(line), "%ld %ld\n", start, now_ns());
+  if (write(fd, line, n) != n)
+    return 1;
+  close(fd);
+  return 0;
+}
+
+/*
+ * stand_in_produce - writes the number of bytes in its argument to stdout
+ */
+static int stand_in_produce(int argc, char **argv)
+{
+  static char buf[IO_BUFFER_SIZE];
+  long left = (argc > 1) ? atol(argv[1]) : 0;
+  ssize_t n;
+
+  memset(buf, 'w', sizeof(buf));
+  while (left > 0)
+  {
+    n = write(1, buf, left < IO_BUFFER_SIZE ? left : IO_BUFFER_SIZE);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    left -= n;
+  }
+  return 0;
+}
+
+/*
+ * stand_in_pass - copies stdin to stdout
+ */
+static int stand_in_pass(int argc, char **argv)
+{
+  static char buf[IO_BUFFER_SIZE];
+  ssize_t n, written, w;
+
+  while ((n = read(0, buf, sizeof(buf))) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    for (written = 0; written < n; written += w)
+    {
+      if ((w = write(1, buf + written, n - written)) < 0)
+      {
+        if (errno != EINTR)
+          return 1;
+        w = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * stand_in_consume - reads stdin to the end, exiting with 1 if fewer bytes
+ * than its argument arrived
+ */
+static int stand_in_consume(int argc, char **argv)
+{
+  static char buf[IO_BUFFER_SIZE];
+  long total = 0, expected = (argc > 1) ? atol(argv[1]) : 0;
+  ssize_t n;
+
+  while ((n = read(0, buf, sizeof(buf))) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    total += n;
+  }
+  return total < expected;
+}
+
+/*
+ * stand_in_sleep - sleeps for the number of milliseconds in its argument
+ */
+static int stand_in_sleep(int argc, char **argv)
+{
+  long ms = (argc > 1) ? atol(argv[1]) : 0;
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+  return 0;
+}
+
+/*
+ * make_stand_ins - links each stand-in's name in work_dir to this program
+ */
+static void make_stand_ins(const char *self)
+{
+  char path[PATH_MAX];
+  size_t i;
+
+  for (i = 0; i < NUM_STAND_INS; i++)
+  {
+    snprintf(path, sizeof(path), "%s/%s", work_dir, stand_ins[i].name);
+    if (symlink(self, path) < 0)
+    {
+      perror(path);
+      exit(1);
+    }
+  }
+}
+
+static void remove_stand_ins(void)
+{
+  char path[PATH_MAX];
+  struct dirent *entry;
+  DIR *dir;
+  int failed = 0;
+
+  /* Nothing but files and symlinks is made in work_dir */
+  if ((dir = opendir(work_dir)) == NULL) {
+    fprintf(stderr, "could not remove %s: %s\n", work_dir, strerror(errno));
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", work_dir, entry->d_name);
+    if (unlink(path) < 0)
+      failed = 1;
+  }
+  closedir(dir);
+
+  if (failed || rmdir(work_dir) < 0)
+    fprintf(stderr, "could not remove %s\n", work_dir);
+}
+
+/*
+ * open_script - creates the script called name in work_dir, storing its path
+ */
+static FILE *open_script(const char *name, char *path)
+{
+  FILE *f;
+
+  snprintf(path, PATH_MAX, "%s/%s.wh", work_dir, name);
+  if ((f = fopen(path, "w")) == NULL)
+  {
+    perror(path);
+    exit(1);
+  }
+  return f;
+}
+
+/*
+ * run_whoosh - runs whoosh on a script with its stdout on /dev/null, returning
+ * the seconds it took, or -1 if it didn't exit cleanly
+ */
+static double run_whoosh(const char *script_path)
+{
+  posix_spawn_file_actions_t actions;
+  const char **argv = malloc((num_whoosh_options + 3) * sizeof(char *));
+  int i, err, status;
+  long start;
+  pid_t pid;
+
+  argv[0] = whoosh;
+  for (i = 0; i < num_whoosh_options; i++)
+    argv[i + 1] = whoosh_options[i];
+  argv[num_whoosh_options + 1] = script_path;
+  argv[num_whoosh_options + 2] = NULL;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+
+  start = now_ns();
+  err = posix_spawn(&pid, whoosh, &actions, NULL, (char * const *)argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  free(argv);
+  if (err != 0)
+  {
+    fprintf(stderr, "%s: %s\n", whoosh, strerror(err));
+    exit(1);
+  }
+
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    fprintf(stderr, "%s failed on %s\n", whoosh, script_path);
+    return -1;
+  }
+  return (now_ns() - start) / 1e9;
+}
+
+/*
+ * bench_single - n groups of one command each
+ */
+static void bench_single(int n)
+{
+  char path[PATH_MAX];
+  FILE *f = open_script("single", path);
+  double seconds;
+  int i;
+
+  for (i = 0; i < n; i++)
+    fprintf(f, "%s/noop" SYNTAX_RESULT "\n", work_dir, "r");
+  fclose(f);
+
+  if ((seconds = run_whoosh(path)) >= 0)
+    report("single", n, seconds, "");
+}
+
+/*
+ * bench_latency - n single commands that each stamp when they start and end.
+ * The gap from one command's end to the next one's start is the time whoosh
+ * took to reap the first and get the second running.
+ */
+static void bench_latency(int n)
+{
+  char path[PATH_MAX], stamps[PATH_MAX], extra[128];
+  FILE *f = open_script("latency", path);
+  long *gaps = malloc(n * sizeof(long)), start, end, prev_end = -1;
+  double seconds;
+  int i, num_gaps = 0;
+
+  snprintf(stamps, sizeof(stamps), "%s/stamps", work_dir);
+  unlink(stamps);
+  for (i = 0; i < n; i++)
+    fprintf(f, "%s/stamp %s\n", work_dir, stamps);
+  fclose(f);
+
+  if ((seconds = run_whoosh(path)) < 0 || (f = fopen(stamps, "r")) == NULL)
+  {
+    free(gaps);
+    return;
+  }
+  while (num_gaps < n && fscanf(f, "%ld %ld", &start, &end) == 2)
+  {
+    if (prev_end >= 0)
+      gaps[num_gaps++] = start - prev_end;
+    prev_end = end;
+  }
+  fclose(f);
+
+  if (num_gaps > 0)
+  {
+    qsort(gaps, num_gaps, sizeof(long), compare_longs);
+    snprintf(extra, sizeof(extra), "spawn latency p50 %ld us, p90 %ld us, p99 %ld us, max %ld us",
+             gaps[num_gaps / 2] / 1000, gaps[num_gaps * 90 / 100] / 1000,
+             gaps[num_gaps * 99 / 100] / 1000, gaps[num_gaps - 1] / 1000);
+  }
+  else
+    snprintf(extra, sizeof(extra), "no stamps");
+  report("latency", n, seconds, extra);
+  free(gaps);
+}
+
+/*
+ * bench_pipeline - pushes pipe_bytes through a pipeline of the given length
+ */
+static void bench_pipeline(int stages)
+{
+  char path[PATH_MAX], name[32], extra[64];
+  FILE *f;
+  double seconds;
+  int i;
+
+  snprintf(name, sizeof(name), "pipeline-%d", stages);
+  f = open_script(name, path);
+  fprintf(f, "%s/produce %ld", work_dir, pipe_bytes);
+  for (i = 1; i < stages - 1; i++)
+    fprintf(f, SYNTAX_AND "%s/pass", work_dir);
+  fprintf(f, SYNTAX_AND "%s/consume %ld" SYNTAX_RESULT "\n", work_dir, pipe_bytes, "r");
+  fclose(f);
+
+  if ((seconds = run_whoosh(path)) >= 0)
+  {
+    snprintf(extra, sizeof(extra), "%.1f MB/s", pipe_bytes / 1e6 / seconds);
+    report(name, stages, seconds, extra);
+  }
+}
+
+/*
+ * bench_race - n OR groups, where one command exits at once and the other
+ * width-1 would sleep for a minute unless whoosh stopped them
+ */
+static void bench_race(int n, int width)
+{
+  char path[PATH_MAX], name[32], extra[64];
+  FILE *f;
+  double seconds;
+  int i, j;
+
+  snprintf(name, sizeof(name), "race-%d", width);
+  f = open_script(name, path);
+  for (i = 0; i < n; i++)
+  {
+    for (j = 1; j < width; j++)
+      fprintf(f, "%s/sleep 60000" SYNTAX_OR, work_dir);
+    fprintf(f, "%s/noop" SYNTAX_RESULT "\n", work_dir, "r");
+  }
+  fclose(f);
+
+  if ((seconds = run_whoosh(path)) >= 0)
+  {
+    snprintf(extra, sizeof(extra), "%.0f us per race", seconds * 1e6 / n);
+    report(name, (long)n * width, seconds, extra);
+  }
+}
+
+/*
+ * bench_repeat - one group that runs program n times
+ */
+static void bench_repeat(int n, const char *program, const char *label)
+{
+  char path[PATH_MAX];
+  FILE *f = open_script(program[0] == '/' ? "repeat-bin" : "repeat", path);
+  double seconds;
+
+  if (program[0] == '/')
+    fprintf(f, SYNTAX_REPEAT "%s" SYNTAX_RESULT "\n", n, program, "r");
+  else
+    fprintf(f, SYNTAX_REPEAT "%s/%s" SYNTAX_RESULT "\n", n, work_dir, program, "r");
+  fclose(f);
+
+  if ((seconds = run_whoosh(path)) >= 0)
+    report(label, n, seconds, "");
+}
+
+static void report(const char *name, long commands, double seconds, const char *extra)
+{
+  printf("%-22s %9ld %9.3f %12.0f  %s\n",
+         name, commands, seconds, seconds > 0 ? commands / seconds : 0.0, extra);
+}
+
+static int compare_longs(const void *a, const void *b)
+{
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+static long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}